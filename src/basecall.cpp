@@ -28,6 +28,7 @@ SOFTWARE.
 
 ******************************************************************************/
 
+#include <algorithm>
 #include <cstdint>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,72 +38,66 @@ SOFTWARE.
 #include "error.h"
 
 void basecall_chunks(
-    std::vector<torch::Tensor> tensors,
-    std::vector<Chunk *> chunks,
-    int chunk_size,
+    chunk_queue_t *queue,
+    int32_t start,
+    int32_t end,
     ModelRunnerBase &model_runner,
     timestamps_t *ts
 ) {
-    for (size_t i = 0; i < tensors.size(); ++i) {
+    std::vector<Chunk *> &chunks = queue->chunks;
+    std::vector<torch::Tensor> &signals = queue->signals;
+
+    for (int32_t i = start; i < end; ++i) {
         ts->time_accept -= realtime();
-        model_runner.accept_chunk(i, tensors[i]);
+        model_runner.accept_chunk(i - start, signals[i], chunks[i]->input_offset);
         ts->time_accept += realtime();
     }
 
     LOG_DEBUG("%s", "decoding chunks");
     ts->time_decode -= realtime();
-    std::vector<DecodedChunk> decoded_chunks = model_runner.call_chunks(chunks.size());
+    std::vector<DecodedChunk> decoded_chunks = model_runner.call_chunks(end - start);
     ts->time_decode += realtime();
 
-    for (size_t i = 0; i < chunks.size(); ++i) {
-        chunks[i]->seq = decoded_chunks[i].sequence;
-        chunks[i]->qstring = decoded_chunks[i].qstring;
-        chunks[i]->moves = decoded_chunks[i].moves;
+    for (int32_t i = start; i < end; ++i) {
+        chunks[i]->seq = decoded_chunks[i - start].sequence;
+        chunks[i]->qstring = decoded_chunks[i - start].qstring;
+        chunks[i]->moves = decoded_chunks[i - start].moves;
     }
 }
 
 void basecall_thread(
     core_t* core,
-    db_t* db,
-    size_t runner_idx,
-    size_t start,
-    size_t end
+    std::vector<chunk_queue_t> *queues,
+    size_t runner_idx
 ) {
     opt_t opt = core->opt;
     timestamps_t *ts = (*core->runner_ts)[runner_idx];
 
-    auto& model_runner = *((*core->runners)[runner_idx]);
-    
-    std::vector<Chunk *> chunks;
-    std::vector<torch::Tensor> tensors;
-
-    for (size_t read_idx = start; read_idx < end; ++read_idx) {
-        for (size_t chunk_idx = 0; chunk_idx < (*db->chunks)[read_idx].size(); ++chunk_idx) {
-            chunks.push_back(((*db->chunks)[read_idx])[chunk_idx]);
-            tensors.push_back((*db->tensors)[read_idx][chunk_idx]);
-
-            if (chunks.size() == (size_t)opt.gpu_batch_size) {
-                basecall_chunks(
-                    tensors,
-                    chunks,
-                    opt.chunk_size,
-                    model_runner,
-                    ts
-                );
-
-                chunks.clear();
-                tensors.clear();
+    //apply the libtorch thread count to this runner thread
+    at::init_num_threads();
+
+    //the queue of the chunk size first, then the chunk buckets from the largest, each with the runner of its chunk size
+    for (int32_t q = (int32_t)queues->size() - 1; q >= 0; --q) {
+        chunk_queue_t *queue = &(*queues)[q];
+        auto& model_runner = (q == opt.num_buckets) ? *((*core->runners)[runner_idx]) : *((*core->bucket_runners)[q][runner_idx]);
+
+        int32_t n_chunks = queue->chunks.size();
+
+        //pull full model batches from the shared queue until it runs dry
+        for (;;) {
+            int32_t start = __sync_fetch_and_add(&queue->next, opt.gpu_batch_size);
+            if (start >= n_chunks) {
+                break;
             }
+            int32_t end = std::min(start + opt.gpu_batch_size, n_chunks);
+
+            basecall_chunks(
+                queue,
+                start,
+                end,
+                model_runner,
+                ts
+            );
         }
     }
-
-    if (chunks.size() > 0) {
-        basecall_chunks(
-            tensors,
-            chunks,
-            opt.chunk_size,
-            model_runner,
-            ts
-        );
-    }
 }
@@ -12,20 +12,25 @@
 #include "slorado.h"
 #include "misc.h"
 
+/* the chunks of a data batch of one chunk size, shared by the model runners which pull them in model batches */
+typedef struct {
+    std::vector<Chunk *> chunks;
+    std::vector<torch::Tensor> signals; //the normalised signal of the read of each chunk (shared, not copied)
+    int32_t next; //index of the next chunk to be pulled
+} chunk_queue_t;
+
 void basecall_chunks(
-    std::vector<torch::Tensor> tensors,
-    std::vector<Chunk *> chunks,
-    int chunk_size,
+    chunk_queue_t *queue,
+    int32_t start,
+    int32_t end,
     ModelRunnerBase &model_runner,
     timestamps_t *ts
 );
 
 void basecall_thread(
     core_t* core,
-    db_t* db,
-    size_t runner_idx,
-    size_t start,
-    size_t end
+    std::vector<chunk_queue_t> *queues,
+    size_t runner_idx
 );
 
-#endif
\ No newline at end of file
+#endif
@@ -43,6 +43,7 @@ SOFTWARE.
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 static struct option long_options[] = {
@@ -62,9 +63,45 @@ static struct option long_options[] = {
     {"num-runners", required_argument, 0, 'r'},     //13 number of runners [1]
     {"emit-fastq", required_argument, 0, 0},        //14 toggles emit fastq
     {"gpu_batchsize", required_argument, 0, 'C'},   //15 gpu batchsize - number of chunks loaded at once [512]
+    {"cpu-budget", required_argument, 0, 0},        //16 number of CPUs shared by all threads [all online CPUs]
+    {"nn-threads", required_argument, 0, 0},        //17 libtorch threads per runner [rest of the budget]
+    {"decode-threads", required_argument, 0, 0},    //18 parallel CPU decode tasks per model batch [same as -t]
+    {"decoder", required_argument, 0, 0},           //19 decoding algorithm beam|viterbi [beam]
+    {"precision", required_argument, 0, 0},         //20 model precision on CPU fp32|int8|bf16 [fp32]
+    {"norm", required_argument, 0, 0},              //21 signal normalisation quantile|medmad [quantile]
+    {"chunk-buckets", required_argument, 0, 0},     //22 smaller chunk sizes for short reads, comma separated [none]
     {0, 0, 0, 0}};
 
 
+static inline const char *get_precision_name(uint64_t flag){
+    if (flag & SLORADO_INT8) {
+        return "int8";
+    } else if (flag & SLORADO_BF16) {
+        return "bf16";
+    }
+    return "fp32";
+}
+
+/* parse a comma separated list of increasing chunk sizes for short reads into opt */
+static void parse_chunk_buckets(opt_t *opt, const char *arg){
+    char *list = strdup(arg);
+    MALLOC_CHK(list);
+    opt->num_buckets = 0;
+    for (char *tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int32_t size = atoi(tok);
+        if (opt->num_buckets == SLORADO_MAX_BUCKETS) {
+            ERROR("At most %d chunk buckets are supported", SLORADO_MAX_BUCKETS);
+            exit(EXIT_FAILURE);
+        }
+        if (size < 1 || (opt->num_buckets > 0 && size <= opt->chunk_buckets[opt->num_buckets - 1])) {
+            ERROR("Chunk buckets should be increasing chunk sizes larger than 0. You entered %s", arg);
+            exit(EXIT_FAILURE);
+        }
+        opt->chunk_buckets[opt->num_buckets++] = size;
+    }
+    free(list);
+}
+
 static inline void print_help_msg(FILE *fp_help, opt_t opt){
     fprintf(fp_help, "usage: slorado basecaller [model] [data]\n");
     fprintf(fp_help, "positional arguments:\n");
@@ -87,11 +124,55 @@ static inline void print_help_msg(FILE *fp_help, opt_t opt){
     fprintf(fp_help, "  --debug-break INT           break after processing the specified no. of batches\n");
     // fprintf(fp_help, "  --emit-fastq=yes|no         emits fastq output format\n");
     fprintf(fp_help, "  --profile-cpu=yes|no        process section by section (used for profiling on CPU)\n");
+    fprintf(fp_help, "  --cpu-budget INT            number of CPUs shared by all threads [all online CPUs]\n");
+    fprintf(fp_help, "  --nn-threads INT            libtorch threads per model runner [rest of the CPU budget]\n");
+    fprintf(fp_help, "  --decode-threads INT        parallel CPU decode tasks per model batch [same as -t]\n");
+    fprintf(fp_help, "  --decoder STR               decoding algorithm on CPU: beam or viterbi (faster, less accurate) [%s]\n", (opt.flag & SLORADO_VIT) ? "viterbi" : "beam");
+    fprintf(fp_help, "  --precision STR             model precision on CPU: fp32, int8 or bf16 (faster, less accurate) [%s]\n", get_precision_name(opt.flag));
+    fprintf(fp_help, "  --chunk-buckets INT,...     smaller chunk sizes for reads that fit them, e.g. 2000,4000 (CPU only) [none]\n");
+    fprintf(fp_help, "  --norm STR                  signal normalisation: quantile or medmad (for med/MAD trained models) [%s]\n", (opt.flag & SLORADO_MEDMAD) ? "medmad" : "quantile");
 #ifdef HAVE_ACC
     // fprintf(fp_help,"   --accel=yes|no             Running on accelerator [%s]\n",(opt.flag&SLORADO_ACC?"yes":"no"));
 #endif
 }
 
+/* argument wrapper for the pipelined processing and output threads */
+typedef struct {
+    core_t* core;
+    db_t* db;
+} pthread_arg2_t;
+
+/* process a data batch (the processing stage of the pipeline) */
+static void* pthread_processor(void* voidargs) {
+    pthread_arg2_t* args = (pthread_arg2_t*)voidargs;
+    db_t* db = args->db;
+    core_t* core = args->core;
+    double realtime0 = core->realtime0;
+
+    process_db(core, db);
+
+    fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) processed\n", __func__,
+            realtime() - realtime0, cputime() / (realtime() - realtime0),
+            db->n_rec, db->sum_bytes/(1000.0*1000.0));
+
+    pthread_exit(0);
+}
+
+/* stitch, write out and free a fully basecalled data batch (the output stage of the pipeline) */
+static void* pthread_post_processor(void* voidargs) {
+    pthread_arg2_t* args = (pthread_arg2_t*)voidargs;
+    db_t* db = args->db;
+    core_t* core = args->core;
+
+    postprocess_db(core, db);
+    output_db(core, db);
+    free_db_tmp(db);
+    free_db(db);
+    free(args);
+
+    pthread_exit(0);
+}
+
 int basecaller_main(int argc, char* argv[]) {
     double realtime0 = realtime();
 
@@ -181,6 +262,54 @@ int basecaller_main(int argc, char* argv[]) {
         #endif
         } else if(c == 0 && longindex == 14) { //sectional benchmark todo : warning for gpu mode
             yes_or_no(&opt.flag, SLORADO_EFQ, long_options[longindex].name, optarg, 1);
+        } else if(c == 0 && longindex == 16) { //cpu budget
+            opt.cpu_budget = atoi(optarg);
+            if (opt.cpu_budget < 1) {
+                ERROR("CPU budget should larger than 0. You entered %d", opt.cpu_budget);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 17) { //model threads per runner
+            opt.nn_threads = atoi(optarg);
+            if (opt.nn_threads < 1) {
+                ERROR("Number of model threads should larger than 0. You entered %d", opt.nn_threads);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 18) { //decode tasks per model batch
+            opt.decode_threads = atoi(optarg);
+            if (opt.decode_threads < 1) {
+                ERROR("Number of decode threads should larger than 0. You entered %d", opt.decode_threads);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 19) { //decoder
+            if (strcmp(optarg, "beam") == 0) {
+                opt.flag &= ~SLORADO_VIT;
+            } else if (strcmp(optarg, "viterbi") == 0) {
+                opt.flag |= SLORADO_VIT;
+            } else {
+                ERROR("Decoder should be beam or viterbi. You entered %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 20) { //model precision
+            opt.flag &= ~(SLORADO_INT8 | SLORADO_BF16);
+            if (strcmp(optarg, "int8") == 0) {
+                opt.flag |= SLORADO_INT8;
+            } else if (strcmp(optarg, "bf16") == 0) {
+                opt.flag |= SLORADO_BF16;
+            } else if (strcmp(optarg, "fp32") != 0) {
+                ERROR("Precision should be fp32, int8 or bf16. You entered %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 21) { //signal normalisation
+            if (strcmp(optarg, "quantile") == 0) {
+                opt.flag &= ~SLORADO_MEDMAD;
+            } else if (strcmp(optarg, "medmad") == 0) {
+                opt.flag |= SLORADO_MEDMAD;
+            } else {
+                ERROR("Normalisation should be quantile or medmad. You entered %s", optarg);
+                exit(EXIT_FAILURE);
+            }
+        } else if(c == 0 && longindex == 22) { //chunk buckets
+            parse_chunk_buckets(&opt, optarg);
         }
     }
 
@@ -213,6 +342,19 @@ int basecaller_main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (opt.num_buckets > 0 && opt.chunk_buckets[opt.num_buckets - 1] >= opt.chunk_size) {
+        ERROR("Chunk buckets should be smaller than the chunk size %d", opt.chunk_size);
+        exit(EXIT_FAILURE);
+    }
+
+    //only the CPU decoder has a viterbi decoder, fall back to beam search before the summary reports it
+    if ((opt.flag & SLORADO_VIT) && strcmp(opt.device, "cpu") != 0) {
+        WARNING("%s", "Viterbi decoding is only supported on the CPU, using beam search");
+        opt.flag &= ~SLORADO_VIT;
+    }
+
+    init_thread_budget(&opt);
+
     // print summary
     fprintf(stderr,"\nslorado base-caller version %s\n", SLORADO_VERSION);
     fprintf(stderr,"model path:         %s\n", model);
@@ -220,10 +362,23 @@ int basecaller_main(int argc, char* argv[]) {
     fprintf(stderr,"output path:        %s\n", opt.out_path == NULL ? "stdout" : opt.out_path);
     fprintf(stderr,"device:             %s\n", opt.device);
     fprintf(stderr,"chunk size:         %d\n", opt.chunk_size);
+    if (opt.num_buckets > 0) {
+        fprintf(stderr,"chunk buckets:      ");
+        for (int32_t b = 0; b < opt.num_buckets; ++b) {
+            fprintf(stderr, b == 0 ? "%d" : ",%d", opt.chunk_buckets[b]);
+        }
+        fprintf(stderr,"\n");
+    }
     fprintf(stderr,"batch size:         %d\n", opt.batch_size);
     fprintf(stderr,"gpu batch size:     %d\n", opt.gpu_batch_size);
     fprintf(stderr,"no. threads:        %d\n", opt.num_thread);
     fprintf(stderr,"no. runners:        %d\n", opt.num_runners);
+    fprintf(stderr,"cpu budget:         %d\n", opt.cpu_budget);
+    fprintf(stderr,"nn threads:         %d per runner\n", opt.nn_threads);
+    fprintf(stderr,"decode threads:     %d\n", opt.decode_threads);
+    fprintf(stderr,"decoder:            %s\n", (opt.flag & SLORADO_VIT) ? "viterbi" : "beam");
+    fprintf(stderr,"precision:          %s\n", get_precision_name(opt.flag));
+    fprintf(stderr,"normalisation:      %s\n", (opt.flag & SLORADO_MEDMAD) ? "medmad" : "quantile");
     fprintf(stderr,"overlap:            %d\n", opt.overlap);
     fprintf(stderr, "\n");
 
@@ -234,39 +389,130 @@ int basecaller_main(int argc, char* argv[]) {
 
     int32_t counter=0;
 
-    //initialise a databatch
-    db_t* db = init_db(core);
-
     ret_status_t status = {core->opt.batch_size,core->opt.batch_size_bytes};
-    while (status.num_reads >= core->opt.batch_size || status.num_bytes>=core->opt.batch_size_bytes) {
-        //load a databatch
-        status = load_db(core, db);
 
-        fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) loaded\n", __func__,
-                realtime() - realtime0, cputime() / (realtime() - realtime0),
-                status.num_reads,status.num_bytes/(1000.0*1000.0));
+    // the last partial model batch of a data batch is held back and basecalled with the next data batch,
+    // so a data batch can only be written out once the data batch after it has been processed
+    if (core->opt.flag & SLORADO_PRF) { //process section by section
+        //initialise the databatches
+        db_t* db = init_db(core);
+        db_t* db_prev = init_db(core);
+        int8_t has_prev = 0;
+
+        while (status.num_reads >= core->opt.batch_size || status.num_bytes>=core->opt.batch_size_bytes) {
+            //load a databatch
+            status = load_db(core, db);
+
+            fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) loaded\n", __func__,
+                    realtime() - realtime0, cputime() / (realtime() - realtime0),
+                    status.num_reads,status.num_bytes/(1000.0*1000.0));
+
+            //process a databatch
+            process_db(core, db);
+
+            fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) processed\n", __func__,
+                    realtime() - realtime0, cputime() / (realtime() - realtime0),
+                    status.num_reads,status.num_bytes/(1000.0*1000.0));
+
+            //the previous databatch is now fully basecalled
+            if (has_prev) {
+                postprocess_db(core, db_prev);
+                output_db(core, db_prev);
+                free_db_tmp(db_prev);
+            }
 
-        //process a databatch
-        process_db(core, db);
+            db_t* tmp = db_prev;
+            db_prev = db;
+            db = tmp;
+            has_prev = 1;
 
-        fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) processed\n", __func__,
-                realtime() - realtime0, cputime() / (realtime() - realtime0),
-                status.num_reads,status.num_bytes/(1000.0*1000.0));
+            if(opt.debug_break==counter){
+                break;
+            }
+            counter++;
+        }
 
-        //output print
-        output_db(core, db);
+        flush_basecall(core);
+        postprocess_db(core, db_prev);
+        output_db(core, db_prev);
+        free_db_tmp(db_prev);
+
+        //free the databatches
+        free_db(db);
+        free_db(db_prev);
+    } else { //pipelined: load batch N+1 and write batch N-2 while batch N is being processed
+        pthread_t tid_proc;
+        pthread_t tid_out;
+        pthread_arg2_t *pt_proc = NULL; //the batch in the processing thread
+        pthread_arg2_t *pt_done = NULL; //the processed batch waiting for its held back chunks
+        pthread_arg2_t *pt_out = NULL; //the batch in the output thread
+        int ret;
+
+        while (status.num_reads >= core->opt.batch_size || status.num_bytes>=core->opt.batch_size_bytes) {
+            //load a databatch
+            db_t* db = init_db(core);
+            status = load_db(core, db);
+
+            fprintf(stderr, "[%s::%.3f*%.2f] %d Entries (%.1fM bytes) loaded\n", __func__,
+                    realtime() - realtime0, cputime() / (realtime() - realtime0),
+                    status.num_reads,status.num_bytes/(1000.0*1000.0));
+
+            if (pt_proc != NULL) {
+                //wait for the previous batch to be processed
+                ret = pthread_join(tid_proc, NULL);
+                NEG_CHK(ret);
+
+                //the batch before that is now fully basecalled
+                if (pt_done != NULL) {
+                    if (pt_out != NULL) {
+                        ret = pthread_join(tid_out, NULL);
+                        NEG_CHK(ret);
+                    }
+                    pt_out = pt_done;
+                    ret = pthread_create(&tid_out, NULL, pthread_post_processor, (void*)pt_out);
+                    NEG_CHK(ret);
+                }
+                pt_done = pt_proc;
+            }
 
-        //free temporary
-        free_db_tmp(db);
+            //process the newly loaded batch
+            pt_proc = (pthread_arg2_t*)malloc(sizeof(pthread_arg2_t));
+            MALLOC_CHK(pt_proc);
+            pt_proc->core = core;
+            pt_proc->db = db;
+            ret = pthread_create(&tid_proc, NULL, pthread_processor, (void*)pt_proc);
+            NEG_CHK(ret);
 
-        if(opt.debug_break==counter){
-            break;
+            if(opt.debug_break==counter){
+                break;
+            }
+            counter++;
         }
-        counter++;
-    }
 
-    //free the databatch
-    free_db(db);
+        //drain the pipeline
+        ret = pthread_join(tid_proc, NULL);
+        NEG_CHK(ret);
+        if (pt_done != NULL) {
+            if (pt_out != NULL) {
+                ret = pthread_join(tid_out, NULL);
+                NEG_CHK(ret);
+            }
+            pt_out = pt_done;
+            ret = pthread_create(&tid_out, NULL, pthread_post_processor, (void*)pt_out);
+            NEG_CHK(ret);
+        }
+
+        flush_basecall(core);
+
+        if (pt_out != NULL) {
+            ret = pthread_join(tid_out, NULL);
+            NEG_CHK(ret);
+        }
+        ret = pthread_create(&tid_out, NULL, pthread_post_processor, (void*)pt_proc);
+        NEG_CHK(ret);
+        ret = pthread_join(tid_out, NULL);
+        NEG_CHK(ret);
+    }
 
     fprintf(stderr, "[%s] total entries: %ld", __func__,(long)core->total_reads);
     fprintf(stderr,"\n[%s] total bytes: %.1f M",__func__,core->sum_bytes/(float)(1000*1000));
@@ -286,9 +532,11 @@ int basecaller_main(int argc, char* argv[]) {
             fprintf(stderr, "\n[%s]             - Accept time: %.3f sec",__func__, runner_ts[i]->time_accept);
             fprintf(stderr, "\n[%s]             - Decode time: %.3f sec",__func__, runner_ts[i]->time_decode);
     }
-            fprintf(stderr, "\n[%s]     - Postprocess time: %.3f sec",__func__, core->postproc_time);
     //}
+    fprintf(stderr, "\n[%s] Data postprocessing time: %.3f sec", __func__,core->postproc_time);
     fprintf(stderr, "\n[%s] Data output time: %.3f sec", __func__,core->output_time);
+    fprintf(stderr, "\n[%s] Thread budget: %d CPUs (%d pool threads for pre/post-processing and %d decode tasks, %d runners x %d model threads)",
+            __func__, core->opt.cpu_budget, get_pool_size(&core->opt), core->opt.decode_threads, core->opt.num_runners, core->opt.nn_threads);
 
     fprintf(stderr,"\n");
 
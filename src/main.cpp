@@ -38,11 +38,13 @@ SOFTWARE.
 #include "slorado.h"
 
 int basecaller_main(int argc, char* argv[]);
+int pack_model_main(int argc, char* argv[]);
 
 int print_usage(FILE *fp_help){
     fprintf(fp_help,"Usage: slorado <command> [options]\n\n");
     fprintf(fp_help,"command:\n");
     fprintf(fp_help,"         basecaller      basecall S/BLOW5 file\n");
+    fprintf(fp_help,"         pack-model      pack a model directory into a single fast loading file\n");
 
     if(fp_help==stderr){
         return(EXIT_FAILURE);
@@ -62,6 +64,8 @@ int main(int argc, char* argv[]){
         return print_usage(stderr);
     } else if (strcmp(argv[1],"basecaller")==0){
         ret=basecaller_main(argc-1, argv+1);
+    } else if (strcmp(argv[1],"pack-model")==0){
+        ret=pack_model_main(argc-1, argv+1);
     } else if (strcmp(argv[1],"subtool2")==0){
         ret=basecaller_main(argc-1, argv+1);
     } else if(strcmp(argv[1],"--version")==0 || strcmp(argv[1],"-V")==0){
@@ -0,0 +1,88 @@
+/**
+ * @file pack_model_main.cpp
+ * @brief entry point to pack_model_main
+ * @author Hasindu Gamaarachchi (hasindu@unsw.edu.au)
+ * @author Bonson Wong (bonson.ym@gmail.com)
+
+MIT License
+
+Copyright (c) 2019 Hasindu Gamaarachchi (hasindu@unsw.edu.au)
+Copyright (c) 2023 Bonson Wong (bonson.ym@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+
+******************************************************************************/
+
+#include "dorado/nn/PackedModel.h"
+#include "error.h"
+#include "misc.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static struct option long_options[] = {
+    {"help", no_argument, 0, 'h'},                  //0
+    {0, 0, 0, 0}};
+
+static inline void print_help_msg(FILE *fp_help){
+    fprintf(fp_help, "usage: slorado pack-model [model] [output]\n");
+    fprintf(fp_help, "packs a model directory into a single file that loads without parsing or copying.\n");
+    fprintf(fp_help, "the packed file can be given to slorado basecaller in place of the model directory.\n");
+    fprintf(fp_help, "positional arguments:\n");
+    fprintf(fp_help, "  model DIR                   the model directory to pack.\n");
+    fprintf(fp_help, "  output FILE                 the packed model file to write.\n");
+    fprintf(fp_help, "\nbasic options:\n");
+    fprintf(fp_help, "  -h                          shows help message and exits\n");
+}
+
+int pack_model_main(int argc, char* argv[]) {
+    double realtime0 = realtime();
+
+    const char* optstring = "h";
+
+    int longindex = 0;
+    int32_t c = -1;
+
+    FILE *fp_help = stderr;
+
+    while ((c = getopt_long(argc, argv, optstring, long_options, &longindex)) >= 0) {
+        if (c == 'h') {
+            fp_help = stdout;
+        }
+    }
+
+    if (argc - optind != 2 || fp_help == stdout) {
+        print_help_msg(fp_help);
+        if(fp_help == stdout){
+            exit(EXIT_SUCCESS);
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    const char *model = argv[optind++];
+    const char *output = argv[optind];
+
+    pack_crf_model(model, output);
+
+    fprintf(stderr, "[%s] packed %s into %s in %.3f sec\n", __func__, model, output, realtime() - realtime0);
+
+    return 0;
+}
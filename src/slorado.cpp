@@ -60,6 +60,61 @@ SOFTWARE.
 #include <vector>
 
 
+/* resolve the automatic thread counts in opt so that all threads fit the CPU budget */
+void init_thread_budget(opt_t* opt) {
+    int8_t user_budget = opt->cpu_budget > 0;
+    if (!user_budget) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        opt->cpu_budget = ncpu > 0 ? (int32_t)ncpu : 1;
+    }
+
+    if (opt->decode_threads == 0) {
+        opt->decode_threads = opt->num_thread;
+    }
+
+    //pre/post-processing and CPU decoding share the worker pool, the rest of the budget goes to the model forward passes
+    int32_t pool_threads = get_pool_size(opt);
+    if (opt->nn_threads == 0) {
+        opt->nn_threads = (opt->cpu_budget - pool_threads) / opt->num_runners;
+        if (opt->nn_threads < 1) {
+            opt->nn_threads = 1;
+        }
+    }
+
+    //the default budget is oversubscribed too when -t alone reaches the number of CPUs
+    int32_t total = pool_threads + opt->nn_threads * opt->num_runners;
+    if (total > opt->cpu_budget) {
+        WARNING("%d threads (%d pool + %d runners x %d model threads) exceed the CPU budget of %d%s",
+                total, pool_threads, opt->num_runners, opt->nn_threads, opt->cpu_budget,
+                user_budget ? "" : " (all online CPUs), consider a smaller -t");
+    }
+}
+
+/* create the CPU model runners: the model weights are loaded once and shared read-only by all runners,
+   only the input buffers (and the activations of the forward passes) are per runner */
+static void init_cpu_runners(core_t* core, char *model, opt_t opt, const DecoderOptions &decoder_options, ModelPrecision precision) {
+    std::shared_ptr<ModelRunner<CPUDecoder>> first;
+    for (int i = 0; i < opt.num_runners; ++i) {
+        if (i == 0) {
+            first = std::make_shared<ModelRunner<CPUDecoder>>(model, opt.device, opt.chunk_size, opt.gpu_batch_size, decoder_options, precision);
+            core->runners->push_back(first);
+        } else {
+            core->runners->push_back(first->share_model());
+        }
+        core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
+        init_timestamps((*core->runner_ts).back());
+    }
+
+    //each runner thread also gets a runner per chunk bucket, on the same weights
+    for (int b = 0; b < opt.num_buckets; ++b) {
+        std::vector<Runner> runners;
+        for (int i = 0; i < opt.num_runners; ++i) {
+            runners.push_back(first->share_model(opt.chunk_buckets[b]));
+        }
+        core->bucket_runners->push_back(runners);
+    }
+}
+
 /* initialise the core data structure */
 core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
     core_t* core = (core_t*)malloc(sizeof(core_t));
@@ -73,20 +128,43 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
 
     init_timestamps(&core->ts);
 
+    //short reads are only bucketed on the CPU, where the model takes any chunk size
+    if (opt.num_buckets > 0 && strcmp(opt.device, "cpu") != 0) {
+        WARNING("%s", "Chunk buckets are only supported on the CPU, using the chunk size for all reads");
+        opt.num_buckets = 0;
+    }
     core->opt = opt;
 
+    //each runner runs its own forward passes, so libtorch gets no inter-op pool of its own
+    torch::set_num_threads(opt.nn_threads);
+    at::set_num_interop_threads(1);
+
     core->runners = new std::vector<Runner>();
+    core->bucket_runners = new std::vector<std::vector<Runner>>();
     core->runner_ts = new std::vector<timestamps_t *>();
+    core->carry_chunks = new std::vector<std::vector<Chunk *>>(opt.num_buckets + 1);
+    core->carry_signals = new std::vector<std::vector<torch::Tensor>>(opt.num_buckets + 1);
+
+    core->pool = init_thread_pool(get_pool_size(&opt));
+
+    DecoderOptions decoder_options;
+    decoder_options.pool = core->pool;
+    decoder_options.num_threads = opt.decode_threads;
+    decoder_options.viterbi = (opt.flag & SLORADO_VIT) ? true : false;
+
+    //only the CPU model can be quantised
+    ModelPrecision cpu_precision = ModelPrecision::FP32;
+    if (opt.flag & SLORADO_INT8) {
+        cpu_precision = ModelPrecision::INT8;
+    } else if (opt.flag & SLORADO_BF16) {
+        cpu_precision = ModelPrecision::BF16;
+    }
 
     core->ts.time_init_runners -= realtime();
 
 #ifdef USE_GPU
     if (strcmp(opt.device, "cpu") == 0) {
-        for (int i = 0; i < opt.num_runners; ++i) {
-            core->runners->push_back(std::make_shared<ModelRunner<CPUDecoder>>(model, opt.device, opt.chunk_size, opt.gpu_batch_size));
-            core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
-            init_timestamps((*core->runner_ts).back());
-        }
+        init_cpu_runners(core, model, opt, decoder_options, cpu_precision);
     } else {
         std::vector<std::string> devices;
         std::string device_name = "";
@@ -111,7 +189,7 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
 #ifdef USE_CUDA_LSTM
                 core->runners->push_back(std::make_shared<CudaModelRunner>(caller, opt.chunk_size, opt.gpu_batch_size));
 #else
-                core->runners->push_back(std::make_shared<ModelRunner<GPUDecoder>>(model, device, opt.chunk_size, opt.gpu_batch_size));
+                core->runners->push_back(std::make_shared<ModelRunner<GPUDecoder>>(model, device, opt.chunk_size, opt.gpu_batch_size, decoder_options));
 #endif
                 core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
                 init_timestamps((*core->runner_ts).back());
@@ -120,11 +198,7 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
     }
 #else
     if (strcmp(opt.device, "cpu") == 0) {
-        for (int i = 0; i < opt.num_runners; ++i) {
-            core->runners->push_back(std::make_shared<ModelRunner<CPUDecoder>>(model, opt.device, opt.chunk_size, opt.gpu_batch_size));
-            core->runner_ts->push_back((timestamps_t *)malloc(sizeof(timestamps_t)));
-            init_timestamps((*core->runner_ts).back());
-        }
+        init_cpu_runners(core, model, opt, decoder_options, cpu_precision);
     } else {
         fprintf(stderr, "Error. Please compile again for GPU\n");
         exit(EXIT_FAILURE);
@@ -140,6 +214,7 @@ core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0) {
 
     core->load_db_time=0;
     core->process_db_time=0;
+    core->parse_time=0;
     core->preproc_time=0;
     core->basecall_time=0;
     core->postproc_time=0;
@@ -171,7 +246,11 @@ void free_core(core_t* core,opt_t opt) {
 
     slow5_close(core->sp);
     delete core->runners;
+    delete core->bucket_runners;
     delete core->runner_ts;
+    free_thread_pool(core->pool);
+    delete core->carry_chunks;
+    delete core->carry_signals;
     free(core);
 }
 
@@ -195,7 +274,9 @@ db_t* init_db(core_t* core) {
     MALLOC_CHK(db->means);
 
     db->chunks = new std::vector<std::vector<Chunk *>>(db->capacity_rec, std::vector<Chunk *>());
-    db->tensors = new std::vector<std::vector<torch::Tensor>>(db->capacity_rec, std::vector<torch::Tensor>());
+    db->signals = new std::vector<torch::Tensor>(db->capacity_rec);
+    db->bucket = (int32_t*)calloc(db->capacity_rec,sizeof(int32_t));
+    MALLOC_CHK(db->bucket);
     db->sequence = new std::vector<char *>(db->capacity_rec, NULL);
     db->qstring = new std::vector<char *>(db->capacity_rec, NULL);
 
@@ -275,56 +356,56 @@ void preprocess_signal(core_t* core,db_t* db, int32_t i){
     opt_t opt = core->opt;
 
     if (len_raw_signal > 0) {
-        torch::Tensor signal = tensor_from_record(rec).to(torch::kCPU);
-
-        scale_signal(signal, rec->range / rec->digitisation, rec->offset);
+        //a view of the record's signal, no copy until normalisation
+        torch::Tensor signal = tensor_from_record(rec);
+
+        SignalNormalisation norm = (opt.flag & SLORADO_MEDMAD) ? SignalNormalisation::MedMad : SignalNormalisation::Quantile;
+        scale_signal(signal, rec->range / rec->digitisation, rec->offset, norm);
+
+        //a read that fits the chunk size of a bucket is run as a single chunk of that size
+        int32_t bucket = opt.num_buckets;
+        int32_t chunk_size = opt.chunk_size;
+        for (int32_t b = 0; b < opt.num_buckets; ++b) {
+            int32_t bucket_size = (int32_t)(*core->bucket_runners)[b][0]->chunk_size();
+            if (signal.size(0) <= bucket_size) {
+                bucket = b;
+                chunk_size = bucket_size;
+                break;
+            }
+        }
+        db->bucket[i] = bucket;
 
-        std::vector<Chunk *> chunks = chunks_from_tensor(signal, opt.chunk_size, opt.overlap);
+        std::vector<Chunk *> chunks = chunks_from_tensor(signal, chunk_size, opt.overlap);
 
         (*db->chunks)[i] = chunks;
         LOG_DEBUG("%s","assigned chunks");
 
-        std::vector<torch::Tensor> tensors = tensor_as_chunks(signal, chunks, opt.chunk_size);
-
-        (*db->tensors)[i] = tensors;
-        LOG_DEBUG("%s","assigned tensors");
+        //the chunks are copied straight from the signal into the model input
+        (*db->signals)[i] = signal;
     }
 }
 
-void basecall_db(core_t* core, db_t* db) {
+/* run all chunks in the queues through the model runners */
+static void basecall_queues(core_t* core, std::vector<chunk_queue_t> *queues) {
     timestamps_t *ts = &(core->ts);
 
     size_t num_threads = (*core->runners).size();
-    size_t n_reads = (*db->chunks).size();
 
     std::vector<std::unique_ptr<std::thread>> threads;
     threads.reserve(num_threads);
 
-    size_t reads_per_thread = (n_reads + num_threads - 1) / num_threads;
-
-    size_t start = 0;
-    size_t end = reads_per_thread;
-
-    bool last = false;
-    for (size_t runner = 0; runner < (*core->runners).size(); ++runner) {
+    for (size_t runner = 0; runner < num_threads; ++runner) {
         threads.emplace_back(
             new std::thread(
                 basecall_thread,
                 core,
-                db,
-                runner,
-                start,
-                end
+                queues,
+                runner
             )
         );
-        start = end;
-        end = std::min(end + reads_per_thread, n_reads);
-
-        if (last) break;
-        if (end == n_reads) last = true;
     }
 
-    auto time_sync = 0;
+    double time_sync = 0;
 
     for (size_t i = 0; i < threads.size(); ++i) {
         threads[i]->join();
@@ -338,6 +419,65 @@ void basecall_db(core_t* core, db_t* db) {
     ts->time_sync += time_sync;
 }
 
+/* basecall the chunks of a data batch, holding back the last partial model batch of each chunk bucket for the next data batch */
+void basecall_db(core_t* core, db_t* db) {
+    int32_t n_queues = core->opt.num_buckets + 1;
+    std::vector<chunk_queue_t> queues(n_queues);
+    std::vector<int32_t> n_carried(n_queues);
+
+    //chunks held back from the previous data batch go first
+    for (int32_t q = 0; q < n_queues; ++q) {
+        queues[q].next = 0;
+        queues[q].chunks.swap((*core->carry_chunks)[q]);
+        queues[q].signals.swap((*core->carry_signals)[q]);
+        n_carried[q] = queues[q].chunks.size();
+    }
+
+    for (int32_t i = 0; i < db->n_rec; ++i) {
+        chunk_queue_t &queue = queues[db->bucket[i]];
+        for (size_t j = 0; j < (*db->chunks)[i].size(); ++j) {
+            queue.chunks.push_back((*db->chunks)[i][j]);
+            queue.signals.push_back((*db->signals)[i]);
+        }
+    }
+
+    //the carried chunks must not be held back twice, as the previous data batch is written out next
+    int32_t n_held = 0;
+    for (int32_t q = 0; q < n_queues; ++q) {
+        chunk_queue_t &queue = queues[q];
+        int32_t n_chunks = queue.chunks.size();
+        int32_t n_full = n_chunks - n_chunks % core->opt.gpu_batch_size;
+        if (n_full >= n_carried[q]) {
+            (*core->carry_chunks)[q].assign(queue.chunks.begin() + n_full, queue.chunks.end());
+            (*core->carry_signals)[q].assign(queue.signals.begin() + n_full, queue.signals.end());
+            queue.chunks.resize(n_full);
+            queue.signals.resize(n_full);
+        }
+        n_held += (*core->carry_chunks)[q].size();
+    }
+    LOG_DEBUG("%d chunks held back", (int)n_held);
+
+    basecall_queues(core, &queues);
+}
+
+/* basecall the chunks held back from the last data batch */
+void flush_basecall(core_t* core) {
+    double a = realtime();
+
+    int32_t n_queues = core->opt.num_buckets + 1;
+    std::vector<chunk_queue_t> queues(n_queues);
+    for (int32_t q = 0; q < n_queues; ++q) {
+        queues[q].next = 0;
+        queues[q].chunks.swap((*core->carry_chunks)[q]);
+        queues[q].signals.swap((*core->carry_signals)[q]);
+    }
+
+    basecall_queues(core, &queues);
+
+    double b = realtime();
+    core->basecall_time += (b-a);
+    core->process_db_time += (b-a);
+}
 
 void postprocess_signal(core_t* core,db_t* db, int32_t i){
     slow5_rec_t* rec = db->slow5_rec[i];
@@ -379,14 +519,17 @@ void process_db(core_t* core,db_t* db){
     core->basecall_time += (b-a);
     LOG_DEBUG("%s","Basecalled reads");
 
-    a = realtime();
+    double proc_end = realtime();
+    core->process_db_time += (proc_end-proc_start);
+}
+
+/* stitch the basecalled chunks of a data batch, once all of its chunks are basecalled */
+void postprocess_db(core_t* core, db_t* db) {
+    double a = realtime();
     work_db(core,db,postprocess_signal);
-    b = realtime();
+    double b = realtime();
     core->postproc_time += (b-a);
     LOG_DEBUG("%s","Postprocessed reads");
-
-    double proc_end = realtime();
-    core->process_db_time += (proc_end-proc_start);
 }
 
 /* write the output for a processed data batch */
@@ -415,6 +558,11 @@ void free_db_tmp(db_t* db) {
         free(db->mem_records[i]);
         free((*db->sequence)[i]);
         free((*db->qstring)[i]);
+        (*db->sequence)[i] = NULL;
+        (*db->qstring)[i] = NULL;
+        for (Chunk *chunk: (*db->chunks)[i]) delete chunk;
+        (*db->chunks)[i].clear();
+        (*db->signals)[i] = torch::Tensor();
     }
 }
 
@@ -429,10 +577,11 @@ void free_db(db_t* db) {
     free(db->mem_records);
     free(db->mem_bytes);
     free(db->means);
+    free(db->bucket);
     delete db->chunks;
     delete db->sequence;
     delete db->qstring;
-    delete db->tensors;
+    delete db->signals;
     free(db);
 }
 
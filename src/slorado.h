@@ -40,6 +40,7 @@ SOFTWARE.
 #include <memory>
 #include "dorado/nn/ModelRunner.h"
 #include "dorado/Chunk.h"
+#include "thread.h"
 
 #define SLORADO_VERSION "0.1.0"
 
@@ -50,6 +51,12 @@ SOFTWARE.
 #define SLORADO_PRF 0x001 //cpu-profile mode
 #define SLORADO_ACC 0x002 //accelerator enable
 #define SLORADO_EFQ 0x004 //emit fastq enable
+#define SLORADO_VIT 0x008 //viterbi decoding instead of beam search
+#define SLORADO_INT8 0x010 //int8 quantised model on the CPU
+#define SLORADO_BF16 0x020 //bf16 model on the CPU
+#define SLORADO_MEDMAD 0x040 //med/MAD signal normalisation instead of quantiles
+
+#define SLORADO_MAX_BUCKETS 8 //max number of smaller chunk sizes for short reads
 
 #define WORK_STEAL 1 //simple work stealing enabled or not (no work stealing mean no load balancing)
 #define STEAL_THRESH 1 //stealing threshold
@@ -71,6 +78,12 @@ typedef struct {
     int32_t chunk_size;         //size of chunks: c
     int32_t overlap;            //overlap: p
     int32_t num_runners;       //number of runners: r
+    int32_t chunk_buckets[SLORADO_MAX_BUCKETS]; //smaller chunk sizes for short reads, ascending (CPU only)
+    int32_t num_buckets;        //number of chunk_buckets in use
+
+    int32_t cpu_budget;         //number of CPUs shared by all threads (0: all online CPUs)
+    int32_t nn_threads;         //libtorch intra-op threads per runner (0: the rest of the budget)
+    int32_t decode_threads;     //parallel CPU decode tasks per model batch (0: same as -t)
 } opt_t;
 
 
@@ -87,7 +100,8 @@ typedef struct {
     double *means;
 
     std::vector<std::vector<Chunk *>> *chunks;
-    std::vector<std::vector<torch::Tensor>> *tensors;
+    std::vector<torch::Tensor> *signals; //normalised signal of each read, cut into chunks by the model runners
+    int32_t *bucket; //chunk bucket of each read (opt.num_buckets: the chunk size)
 
     std::vector<char *> *sequence;
     std::vector<char *> *qstring;
@@ -126,9 +140,14 @@ typedef struct {
     // options
     opt_t opt;
 
+    //worker threads shared by the pre/post-processing and the CPU decoding
+    thread_pool_t *pool;
+
     // create model runner
     // only one is used for now
     std::vector<Runner> *runners;
+    //runners for the shorter chunks of the chunk buckets, indexed [bucket][runner]
+    std::vector<std::vector<Runner>> *bucket_runners;
 
     //realtime0
     double realtime0;
@@ -143,34 +162,27 @@ typedef struct {
     timestamps_t ts;
     std::vector<timestamps_t *> *runner_ts;
 
+    //chunks of the last partial model batch, held back to be filled up by the next data batch
+    //one list per chunk bucket, the last one for the chunk size
+    std::vector<std::vector<Chunk *>> *carry_chunks;
+    std::vector<std::vector<torch::Tensor>> *carry_signals;
+
     //stats //set by output_db
     int64_t sum_bytes;
     int64_t total_reads; //total number mapped entries in the bam file (after filtering based on flags, mapq etc)
 } core_t;
 
-/* argument wrapper for the multithreaded framework used for data processing */
-typedef struct {
-    core_t* core;
-    db_t* db;
-    int32_t starti;
-    int32_t endi;
-    void (*func)(core_t*,db_t*,int);
-    int32_t thread_index;
-#ifdef WORK_STEAL
-    void *all_pthread_args;
-#endif
-#ifdef HAVE_CUDA
-    int32_t *ultra_long_reads; //reads that are assigned to the CPU due to the unsuitability to process on the GPU
-    double ret1;    //return value
-#endif
-} pthread_arg_t;
-
 /* return status by the load_db - used for termination when all the data is processed */
 typedef struct {
     int32_t num_reads;
     int64_t num_bytes;
 } ret_status_t;
 
+/* number of worker threads in the pool shared by pre/post-processing and CPU decoding */
+static inline int32_t get_pool_size(const opt_t* opt) {
+    return opt->num_thread > opt->decode_threads ? opt->num_thread : opt->decode_threads;
+}
+
 /******************************************
  * function prototype for major functions *
  ******************************************/
@@ -178,6 +190,9 @@ typedef struct {
 /* initialise user specified options */
 void init_opt(opt_t* opt);
 
+/* resolve the automatic thread counts in opt so that all threads fit the CPU budget */
+void init_thread_budget(opt_t* opt);
+
 /* initialise the core data structure */
 core_t* init_core(char *slow5file, opt_t opt, char *model, double realtime0);
 
@@ -194,6 +209,12 @@ void work_db(core_t* core, db_t* db, void (*func)(core_t*,db_t*,int));
 /* process a data batch */
 void process_db(core_t* core, db_t* db);
 
+/* basecall the chunks held back from the last data batch */
+void flush_basecall(core_t* core);
+
+/* stitch the basecalled chunks of a data batch (all its chunks must have been basecalled) */
+void postprocess_db(core_t* core, db_t* db);
+
 /* align a single read specified by index i*/
 void process_single(core_t* core, db_t* db, int32_t i);
 
@@ -30,17 +30,18 @@ SOFTWARE.
 
 #include <pthread.h>
 #include "slorado.h"
+#include "thread.h"
 #include "error.h"
 #include "misc.h"
 
-static inline int32_t steal_work(pthread_arg_t* all_args, int32_t n_threads) {
+static inline int32_t steal_work(pool_slice_t* slices, int32_t num_slice) {
 	int32_t i, c_i = -1;
 	int32_t k;
-	for (i = 0; i < n_threads; ++i){
-        pthread_arg_t args = all_args[i];
-        //fprintf(stderr,"endi : %d, starti : %d\n",args.endi,args.starti);
-		if (args.endi-args.starti > STEAL_THRESH) {
-            //fprintf(stderr,"gap : %d\n",args.endi-args.starti);
+	for (i = 0; i < num_slice; ++i){
+        pool_slice_t slice = slices[i];
+        //fprintf(stderr,"endi : %d, starti : %d\n",slice.endi,slice.starti);
+		if (slice.endi-slice.starti > STEAL_THRESH) {
+            //fprintf(stderr,"gap : %d\n",slice.endi-slice.starti);
             c_i = i;
             break;
         }
@@ -48,81 +49,185 @@ static inline int32_t steal_work(pthread_arg_t* all_args, int32_t n_threads) {
     if(c_i<0){
         return -1;
     }
-	k = __sync_fetch_and_add(&(all_args[c_i].starti), 1);
-    //fprintf(stderr,"k : %d, end %d, start %d\n",k,all_args[c_i].endi,all_args[c_i].starti);
-	return k >= all_args[c_i].endi ? -1 : k;
+	k = __sync_fetch_and_add(&(slices[c_i].starti), 1);
+    //fprintf(stderr,"k : %d, end %d, start %d\n",k,slices[c_i].endi,slices[c_i].starti);
+	return k >= slices[c_i].endi ? -1 : k;
 }
 
-void* pthread_single(void* voidargs) {
+/* process one slice of a job, then help with the slices of the others */
+static void pool_work(pool_job_t *job, int32_t slice_idx, int32_t worker) {
     int32_t i;
-    pthread_arg_t* args = (pthread_arg_t*)voidargs;
-    db_t* db = args->db;
-    core_t* core = args->core;
+    pool_slice_t* slice = &job->slices[slice_idx];
 
 #ifndef WORK_STEAL
-    for (i = args->starti; i < args->endi; i++) {
-        args->func(core,db,i);
+    for (i = slice->starti; i < slice->endi; i++) {
+        job->func(job->arg, i, worker);
     }
 #else
-    pthread_arg_t* all_args = (pthread_arg_t*)(args->all_pthread_args);
     //adapted from kthread.c in minimap2
     for (;;) {
-		i = __sync_fetch_and_add(&args->starti, 1);
-		if (i >= args->endi) {
+		i = __sync_fetch_and_add(&slice->starti, 1);
+		if (i >= slice->endi) {
             break;
         }
-		args->func(core,db,i);
+		job->func(job->arg, i, worker);
 	}
-	while ((i = steal_work(all_args,core->opt.num_thread)) >= 0){
-		args->func(core,db,i);
+	while ((i = steal_work(job->slices, job->num_slice)) >= 0){
+		job->func(job->arg, i, worker);
     }
 #endif
+}
+
+typedef struct {
+    thread_pool_t *pool;
+    int32_t worker;
+} pool_worker_arg_t;
+
+static void* pool_worker(void* voidargs) {
+    pool_worker_arg_t* args = (pool_worker_arg_t*)voidargs;
+    thread_pool_t *pool = args->pool;
+    int32_t worker = args->worker;
+    free(args);
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->head == NULL && !pool->terminate) {
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        }
+        if (pool->head == NULL) { //terminating and no work left
+            break;
+        }
+
+        //claim the next slice of the oldest job
+        pool_job_t *job = pool->head;
+        int32_t slice_idx = job->next_slice++;
+        if (job->next_slice == job->num_slice) {
+            pool->head = job->next;
+            if (pool->head == NULL) {
+                pool->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool_work(job, slice_idx, worker);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->num_done++;
+        if (job->num_done == job->num_slice) {
+            pthread_cond_signal(&job->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
 
-    //fprintf(stderr,"Thread %d done\n",(myargs->position)/THREADS);
     pthread_exit(0);
 }
 
-void pthread_db(core_t* core, db_t* db, void (*func)(core_t*,db_t*,int)){
-    //create threads
-    pthread_t tids[core->opt.num_thread];
-    pthread_arg_t pt_args[core->opt.num_thread];
-    int32_t t, ret;
+thread_pool_t *init_thread_pool(int32_t num_thread) {
+    thread_pool_t *pool = (thread_pool_t *)malloc(sizeof(thread_pool_t));
+    MALLOC_CHK(pool);
+
+    pool->num_thread = num_thread;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->terminate = 0;
+
+    int ret = pthread_mutex_init(&pool->mutex, NULL);
+    NEG_CHK(ret);
+    ret = pthread_cond_init(&pool->work, NULL);
+    NEG_CHK(ret);
+
+    pool->tids = (pthread_t *)malloc(num_thread * sizeof(pthread_t));
+    MALLOC_CHK(pool->tids);
+
+    for (int32_t t = 0; t < num_thread; t++) {
+        pool_worker_arg_t *args = (pool_worker_arg_t *)malloc(sizeof(pool_worker_arg_t));
+        MALLOC_CHK(args);
+        args->pool = pool;
+        args->worker = t;
+        ret = pthread_create(&pool->tids[t], NULL, pool_worker, (void*)args);
+        NEG_CHK(ret);
+    }
+
+    return pool;
+}
+
+void thread_pool_run(thread_pool_t *pool, int32_t n, void (*func)(void *, int32_t, int32_t), void *arg) {
+    if (n <= 0) {
+        return;
+    }
+
+    if (pool == NULL) {
+        for (int32_t i = 0; i < n; i++) {
+            func(arg, i, 0);
+        }
+        return;
+    }
+
+    //split the range into one slice per worker
+    int32_t num_slice = pool->num_thread < n ? pool->num_thread : n;
+    int32_t step = (n + num_slice - 1) / num_slice;
+    pool_slice_t slices[num_slice];
     int32_t i = 0;
-    int32_t num_thread = core->opt.num_thread;
-    int32_t step = (db->n_rec + num_thread - 1) / num_thread;
-    //todo : check for higher num of threads than the data
-    //current works but many threads are created despite
-
-    //set the data structures
-    for (t = 0; t < num_thread; t++) {
-        pt_args[t].core = core;
-        pt_args[t].db = db;
-        pt_args[t].starti = i;
+    for (int32_t t = 0; t < num_slice; t++) {
+        slices[t].starti = i;
         i += step;
-        if (i > db->n_rec) {
-            pt_args[t].endi = db->n_rec;
-        } else {
-            pt_args[t].endi = i;
-        }
-        pt_args[t].func=func;
-    #ifdef WORK_STEAL
-        pt_args[t].all_pthread_args =  (void *)pt_args;
-    #endif
-        //fprintf(stderr,"t%d : %d-%d\n",t,pt_args[t].starti,pt_args[t].endi);
+        slices[t].endi = i > n ? n : i;
     }
 
-    //create threads
-    for(t = 0; t < core->opt.num_thread; t++){
-        ret = pthread_create(&tids[t], NULL, pthread_single,
-                                (void*)(&pt_args[t]));
-        NEG_CHK(ret);
+    pool_job_t job;
+    job.func = func;
+    job.arg = arg;
+    job.slices = slices;
+    job.num_slice = num_slice;
+    job.next_slice = 0;
+    job.num_done = 0;
+    job.next = NULL;
+    int ret = pthread_cond_init(&job.done, NULL);
+    NEG_CHK(ret);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail == NULL) {
+        pool->head = &job;
+    } else {
+        pool->tail->next = &job;
     }
+    pool->tail = &job;
+    pthread_cond_broadcast(&pool->work);
 
-    //pthread joining
-    for (t = 0; t < core->opt.num_thread; t++) {
-        int ret = pthread_join(tids[t], NULL);
+    while (job.num_done < job.num_slice) {
+        pthread_cond_wait(&job.done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_cond_destroy(&job.done);
+}
+
+void free_thread_pool(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->terminate = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int32_t t = 0; t < pool->num_thread; t++) {
+        int ret = pthread_join(pool->tids[t], NULL);
         NEG_CHK(ret);
     }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    free(pool->tids);
+    free(pool);
+}
+
+typedef struct {
+    core_t* core;
+    db_t* db;
+    void (*func)(core_t*,db_t*,int);
+} work_db_arg_t;
+
+static void work_db_single(void *voidargs, int32_t i, int32_t worker) {
+    work_db_arg_t* args = (work_db_arg_t*)voidargs;
+    args->func(args->core, args->db, i);
 }
 
 /* process all reads in the given batch db */
@@ -135,6 +240,7 @@ void work_db(core_t* core, db_t* db, void (*func)(core_t*,db_t*,int)){
     }
 
     else {
-        pthread_db(core,db,func);
+        work_db_arg_t args = {core, db, func};
+        thread_pool_run(core->pool, db->n_rec, work_db_single, (void*)&args);
     }
 }
@@ -0,0 +1,52 @@
+/* @file thread.h
+**
+** a pool of long-lived worker threads
+** @@
+******************************************************************************/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* a range of indices of a pool job, owned by one worker (others may steal from it) */
+typedef struct {
+    int32_t starti;
+    int32_t endi;
+} pool_slice_t;
+
+/* a parallel loop submitted to the thread pool */
+typedef struct pool_job_s {
+    void (*func)(void *, int32_t, int32_t); //called as func(arg, index, worker index)
+    void *arg;
+    pool_slice_t *slices;       //the index range, split evenly into one slice per worker
+    int32_t num_slice;
+    int32_t next_slice;         //next slice to be claimed by a worker
+    int32_t num_done;           //number of workers done with the job
+    pthread_cond_t done;        //signalled when all workers are done with the job
+    struct pool_job_s *next;    //next job in the queue
+} pool_job_t;
+
+/* a pool of worker threads shared by all processing stages, created once for the whole run */
+typedef struct {
+    int32_t num_thread;
+    pthread_t *tids;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        //signalled when a job is queued
+    pool_job_t *head;           //jobs which still have unclaimed slices
+    pool_job_t *tail;
+    int8_t terminate;
+} thread_pool_t;
+
+/* create a pool of num_thread workers */
+thread_pool_t *init_thread_pool(int32_t num_thread);
+
+/* call func(arg, i, worker) for each i in [0, n) on the pool and wait until all are done
+   (runs on the calling thread with worker index 0 if pool is NULL) */
+void thread_pool_run(thread_pool_t *pool, int32_t n, void (*func)(void *, int32_t, int32_t), void *arg);
+
+/* stop and free the pool */
+void free_thread_pool(thread_pool_t *pool);
+
+#endif
@@ -58,13 +58,15 @@ download_minimap2 () {
     fi
 }
 
+# check_accuracy MEDIAN [THRESHOLD], the threshold is 0.8 by default
 check_accuracy () {
-    if (( $(echo "$1 >= 0.8" | bc -l) ));
+    THRESHOLD=${2:-0.8}
+    if (( $(echo "$1 >= $THRESHOLD" | bc -l) ));
     then
         return 0
     fi
 
-    die "Failed accuracy test with value of $2"
+    die "Failed accuracy test with value of $1"
 }
 
 test -d models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 || download_model
@@ -72,9 +74,38 @@ test -e minimap2/minimap2 || download_minimap2
 
 #make clean && make -j cuda=1 koi=1 CUDA_ROOT=/data/install/cuda-11.3
 
-# echo "Test 1"
+echo "Test 1"
 ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 --device "$DEVICE" > test/tmp.fastq  || die "Running the tool failed"
 minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
 check_accuracy $(awk '{print $10/$11}' test/tmp.paf | datamash median 1)
 
+echo "Test 2: int8 precision on the CPU"
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 -xcpu --precision int8 > test/tmp.fastq  || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+check_accuracy $(awk '{print $10/$11}' test/tmp.paf | datamash median 1)
+
+echo "Test 3: bf16 precision on the CPU (falls back to fp32 with a warning on CPUs without bf16)"
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 -xcpu --precision bf16 > test/tmp.fastq  || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+check_accuracy $(awk '{print $10/$11}' test/tmp.paf | datamash median 1)
+
+echo "Test 4: viterbi decoder on the CPU"
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 -xcpu --decoder viterbi > test/tmp.fastq  || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+# viterbi keeps only the best path, so it is allowed a little below the beam search threshold
+check_accuracy $(awk '{print $10/$11}' test/tmp.paf | datamash median 1) 0.78
+
+echo "Test 5: packed model on the CPU"
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 -xcpu > test/tmp.fastq  || die "Running the tool failed"
+ex  ./slorado pack-model models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/tmp.pack || die "Packing the model failed"
+ex  ./slorado basecaller test/tmp.pack test/oneread_r10.blow5 -xcpu > test/tmp_packed.fastq  || die "Running the tool on the packed model failed"
+# the packed weights replace the parameters as they are, so the output must not change
+diff -q test/tmp.fastq test/tmp_packed.fastq || die "The packed model gave a different output"
+
+echo "Test 6: chunk buckets on the CPU"
+# with one read per data batch, its partial model batch is held back and run by the final flush
+ex  ./slorado basecaller models/dna_r10.4.1_e8.2_400bps_fast@v4.0.0 test/oneread_r10.blow5 -xcpu --chunk-buckets 2000,4000 -K1 > test/tmp.fastq  || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont test/chr4_90700000_90900000.fa test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+check_accuracy $(awk '{print $10/$11}' test/tmp.paf | datamash median 1)
+
 echo "Tests passed"
@@ -24,27 +24,19 @@ ex() {
     "$@"
 }
 
+# check_accuracy MODEL MEDIAN [THRESHOLD], where THRESHOLD overrides the model's own threshold
 check_accuracy () {
     case $1 in
     $FAST )
-        if (( $(echo "$2 >= 0.92" | bc -l) ));
-        then
-            return 0
-        fi
+        THRESHOLD=0.92
         ;;
 
     $HAC )
-        if (( $(echo "$2 >= 0.97" | bc -l) ));
-        then
-            return 0
-        fi
+        THRESHOLD=0.97
         ;;
 
     $SUP )
-        if (( $(echo "$2 >= 0.98" | bc -l) ));
-        then
-            return 0
-        fi
+        THRESHOLD=0.98
         ;;
 
     *)
@@ -52,6 +44,12 @@ check_accuracy () {
         ;;
     esac
 
+    test -n "$3" && THRESHOLD=$3
+    if (( $(echo "$2 >= $THRESHOLD" | bc -l) ));
+    then
+        return 0
+    fi
+
     die "$1 failed accuracy test with value of $2"
 }
 
@@ -112,3 +110,46 @@ MEDIAN=$(awk '{print $10/$11}' test/tmp.paf | datamash median 1 || die "datamash
 check_accuracy $SUP $MEDIAN
 echo ""
 echo "********************************************************************"
+
+# int8 scores are expanded back to float in the viterbi scan, so this checks the whole int8 path
+echo "CPU - FAST model - int8 precision - viterbi decoder - 20k reads"
+ex  ./slorado basecaller models/$FAST $SUBSAMPLE -xcpu --precision int8 --decoder viterbi > test/tmp.fastq || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont $REFERENC_GENOME test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+MEDIAN=$(awk '{print $10/$11}' test/tmp.paf | datamash median 1 || die "datamash failed")
+# both int8 and viterbi trade a little accuracy for speed
+check_accuracy $FAST $MEDIAN 0.9
+echo ""
+echo "********************************************************************"
+
+# the quantile normalisation is computed from an int16 histogram instead of sorting, and must give
+# exactly the output of the last revision that sorted (set BASELINE_REV to compare with another)
+BASELINE_REV=${BASELINE_REV:-e6aa9a2}
+echo "CPU - FAST model - quantile normalisation against $BASELINE_REV - 1000 reads"
+rm -rf test/tmp_baseline
+git worktree add --detach test/tmp_baseline $BASELINE_REV || die "Checking out $BASELINE_REV failed"
+git -C test/tmp_baseline submodule update --init || die "Checking out the submodules of $BASELINE_REV failed"
+make -C test/tmp_baseline -j LIBTORCH_DIR=$(realpath ${LIBTORCH_DIR:-thirdparty/torch/libtorch}) || die "Building $BASELINE_REV failed"
+test/tmp_baseline/slorado basecaller models/$FAST $SUBSAMPLE -xcpu -K1000 --debug-break 0 > test/tmp_baseline.fastq || die "Running $BASELINE_REV failed"
+ex  ./slorado basecaller models/$FAST $SUBSAMPLE -xcpu -K1000 --debug-break 0 > test/tmp.fastq || die "Running the tool failed"
+diff -q test/tmp_baseline.fastq test/tmp.fastq || die "The quantile normalisation changed the output"
+git worktree remove --force test/tmp_baseline
+echo ""
+echo "********************************************************************"
+
+echo "GPU - FAST model - medmad normalisation - 20k reads"
+ex  ./slorado basecaller models/$FAST $SUBSAMPLE -xcuda:0,1,2,3 -B500M -c10000 -C1900 --norm medmad > test/tmp.fastq || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont $REFERENC_GENOME test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+MEDIAN=$(awk '{print $10/$11}' test/tmp.paf | datamash median 1 || die "datamash failed")
+# the model was trained on quantile normalised signals, so med/MAD only has to come close
+check_accuracy $FAST $MEDIAN 0.9
+echo ""
+echo "********************************************************************"
+
+# small data and model batches, so that every bucket carries partial model batches between data batches
+echo "CPU - FAST model - chunk buckets - 1000 reads"
+ex  ./slorado basecaller models/$FAST $SUBSAMPLE -xcpu --chunk-buckets 2000,4000 -K200 -C64 --debug-break 4 > test/tmp.fastq || die "Running the tool failed"
+minimap2/minimap2 -cx map-ont $REFERENC_GENOME test/tmp.fastq --secondary=no > test/tmp.paf || die "minimap2 failed"
+MEDIAN=$(awk '{print $10/$11}' test/tmp.paf | datamash median 1 || die "datamash failed")
+check_accuracy $FAST $MEDIAN
+echo ""
+echo "********************************************************************"
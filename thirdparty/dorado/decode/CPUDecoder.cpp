@@ -1,143 +1,172 @@
 #include "CPUDecoder.h"
 
 #include "beam_search.h"
+#include "crf_scan.h"
 
-#include <math.h>
 #include <torch/torch.h>
 
+#include <algorithm>
+#include <utility>
 #include <vector>
 
-at::Tensor scan(const torch::Tensor& Ms,
-                const float fixed_stay_score,
-                const torch::Tensor& idx,
-                const torch::Tensor& v0) {
-    const int T = Ms.size(0);
-    const int N = Ms.size(1);
-    const int C = Ms.size(2);
-
-    torch::Tensor alpha = Ms.new_full({T + 1, N, C}, -1E38);
-    alpha[0] = v0;
-
-    for (int t = 0; t < T; t++) {
-        auto scored_steps = torch::add(alpha.index({t, torch::indexing::Slice(), idx}), Ms[t]);
-        auto scored_stay = torch::add(alpha.index({t, torch::indexing::Slice()}), fixed_stay_score)
-                                   .unsqueeze(-1);
-        auto scored_transitions = torch::cat({scored_stay, scored_steps}, -1);
-
-        alpha[t + 1] = torch::logsumexp(scored_transitions, -1);
+struct DecodeTask {
+    torch::Tensor scores_cpu;  // {N, T, C}, contiguous, float or int8
+    const DecoderOptions* options;
+    std::vector<DecodedChunk>* chunk_results;
+    int num_tasks;
+    int chunks_per_task;
+    int num_tasks_with_one_more_chunk;
+};
+
+// Most floats of guides and posteriors a decoding thread keeps for the chunks it beam searches
+// together (32 MB)
+static const int64_t max_lane_buffer_floats = int64_t(1) << 23;
+
+// A {rows, cols} float view of the flat workspace tensor buffer, which is only reallocated when it
+// is too small
+static torch::Tensor workspace_buffer(torch::Tensor& buffer, int64_t rows, int64_t cols) {
+    if (!buffer.defined() || buffer.numel() < rows * cols) {
+        buffer = torch::empty({rows * cols}, torch::kFloat32);
     }
-
-    return alpha;
-}
-
-torch::Tensor forward_scores(const torch::Tensor& scores, const float fixed_stay_score) {
-    const int T = scores.size(0);  // Signal len
-    const int N = scores.size(1);  // Num batches
-    const int C = scores.size(2);  // 4^state_len * 4 = 4^(state_len + 1)
-
-    const int n_base = 4;
-    const int state_len = std::log(C) / std::log(n_base) - 1;
-
-    // Transition scores reshaped so that the 4 scores for each predecessor state are arranged along the
-    // innermost dimension.
-    const torch::Tensor Ms = scores.reshape({T, N, -1, n_base});
-
-    // Number of states per timestep.
-    const int num_states = pow(n_base, state_len);
-
-    // Guide values at first timestep.
-    const auto v0 = Ms.new_full({{N, num_states}}, 0.0f);
-
-    // For each state, the indices of the 4 states that could precede it via a step transition.
-    const auto idx = torch::arange(num_states)
-                             .repeat_interleave(n_base)
-                             .reshape({n_base, -1})
-                             .t()
-                             .contiguous();
-
-    return scan(Ms, fixed_stay_score, idx, v0);
+    return buffer.narrow(0, 0, rows * cols).view({rows, cols});
 }
 
-torch::Tensor backward_scores(const torch::Tensor& scores, const float fixed_stay_score) {
-    const int N = scores.size(1);  // Num batches
-    const int C = scores.size(2);  // 4^state_len * 4 = 4^(state_len + 1)
-
-    const int n_base = 4;
-
-    const int state_len = std::log(C) / std::log(n_base) - 1;
-
-    // Number of states per timestep.
-    const int num_states = pow(n_base, state_len);
-
-    // Guide values at last timestep.
-    const torch::Tensor vT = scores.new_full({N, num_states}, 0.0f);
-
-    const auto idx = torch::arange(num_states)
-                             .repeat_interleave(n_base)
-                             .reshape({n_base, -1})
-                             .t()
-                             .contiguous();
-    auto idx_T = idx.flatten().argsort().reshape(idx.sizes());
-
-    const auto Ms_T = scores.index({torch::indexing::Slice(), torch::indexing::Slice(), idx_T});
-
-    // For each state, the indices of the 4 states that could succeed it via a step transition.
-    idx_T = torch::bitwise_right_shift(idx_T, 2);
-
-    return scan(Ms_T.flip(0), fixed_stay_score, idx_T.to(torch::kInt64), vT).flip(0);
+static void decode_task(void* arg, int32_t i, int32_t worker) {
+    const DecodeTask& task = *static_cast<DecodeTask*>(arg);
+    const DecoderOptions& options = *task.options;
+
+    int t_first_chunk = i * task.chunks_per_task + std::min(i, task.num_tasks_with_one_more_chunk);
+    int t_num_chunks = task.chunks_per_task + int(i < task.num_tasks_with_one_more_chunk);
+
+    const int T = task.scores_cpu.size(1);
+    const int C = task.scores_cpu.size(2);
+    const int num_states = C / 4;
+
+    // The guides and posteriors are computed into buffers of the thread's workspace, reused for all
+    // chunks and batches, so the decoder memory does not grow with the model batch size. The
+    // forward guides are computed into posts and turned into the posteriors in place. Up to
+    // beam_search_lanes_max_width, the beam search decodes up to beam_search_max_lanes chunks
+    // together, so the buffers hold that many chunks, as long as they stay within
+    // max_lane_buffer_floats. Wider beams are searched one chunk at a time.
+    const bool decode_lanes =
+            !options.viterbi && options.beam_width <= beam_search_lanes_max_width;
+    const int64_t chunk_floats = int64_t(T + 1) * num_states;
+    const int max_lanes =
+            !decode_lanes ? 1
+                          : int(std::max<int64_t>(
+                                    1, std::min<int64_t>(beam_search_max_lanes,
+                                                         max_lane_buffer_floats /
+                                                                 (2 * chunk_floats))));
+    DecoderWorkspace& workspace = decoder_workspace();
+    auto bwd = workspace_buffer(workspace.bwd, max_lanes * int64_t(T + 1), num_states);
+    auto posts = workspace_buffer(workspace.posts, max_lanes * int64_t(T + 1), num_states);
+
+    // int8 scores are expanded to floats for the scans, one chunk at a time
+    const bool int8_scores = task.scores_cpu.scalar_type() == torch::kInt8;
+    auto float_buffer =
+            int8_scores ? workspace_buffer(workspace.float_scores, T, C) : torch::Tensor();
+
+    // The sequences, qstrings and moves are moved into the chunk results, not copied
+    const auto store_result =
+            [&](int chunk_idx,
+                std::tuple<std::string, std::string, std::vector<uint8_t>>&& decode_result) {
+                (*task.chunk_results)[chunk_idx] = DecodedChunk{
+                        std::move(std::get<0>(decode_result)),
+                        std::move(std::get<1>(decode_result)),
+                        std::move(std::get<2>(decode_result)),
+                };
+            };
+
+    std::vector<torch::Tensor> lane_scores, lane_bwd, lane_posts;
+    for (int first_lane_chunk = 0; first_lane_chunk < t_num_chunks; first_lane_chunk += max_lanes) {
+        const int num_lanes = std::min(max_lanes, t_num_chunks - first_lane_chunk);
+        lane_scores.clear();
+        lane_bwd.clear();
+        lane_posts.clear();
+        for (int l = 0; l < num_lanes; l++) {
+            const int chunk_idx = t_first_chunk + first_lane_chunk + l;
+            auto chunk_scores = task.scores_cpu[chunk_idx];
+            auto float_scores = chunk_scores;
+            if (int8_scores) {
+                const int8_t* q = chunk_scores.data_ptr<int8_t>();
+                float* f = float_buffer.data_ptr<float>();
+                for (int64_t j = 0; j < int64_t(T) * C; j++) {
+                    f[j] = q[j] * options.byte_score_scale;
+                }
+                float_scores = float_buffer;
+            }
+            const float* scores_ptr = float_scores.data_ptr<float>();
+            auto chunk_bwd = bwd.narrow(0, l * int64_t(T + 1), T + 1);
+            auto chunk_posts = posts.narrow(0, l * int64_t(T + 1), T + 1);
+            float* bwd_ptr = chunk_bwd.data_ptr<float>();
+            float* posts_ptr = chunk_posts.data_ptr<float>();
+
+            if (options.viterbi) {
+                // No backward pass: the best path scores go in bwd and their row-wise softmax
+                // (forward-only state probabilities) in posts for an approximate qstring
+                crf_viterbi_scan(scores_ptr, C, T, num_states, options.blank_score, bwd_ptr,
+                                 num_states);
+                std::copy(bwd_ptr, bwd_ptr + chunk_floats, posts_ptr);
+                crf_posteriors(posts_ptr, nullptr, T, num_states);
+
+                store_result(chunk_idx,
+                             viterbi_decode(float_scores, chunk_bwd, chunk_posts,
+                                            options.blank_score, options.q_shift, options.q_scale));
+                continue;
+            }
+
+            crf_forward_scan(scores_ptr, C, T, num_states, options.blank_score, posts_ptr,
+                             num_states);
+            crf_backward_scan(scores_ptr, C, T, num_states, options.blank_score, bwd_ptr,
+                              num_states);
+            crf_posteriors(posts_ptr, bwd_ptr, T, num_states);
+            if (!decode_lanes) {
+                store_result(chunk_idx,
+                             beam_search_decode(chunk_scores, chunk_bwd, chunk_posts,
+                                                options.beam_width, options.beam_cut,
+                                                options.blank_score, options.q_shift,
+                                                options.q_scale, options.temperature,
+                                                options.byte_score_scale));
+                continue;
+            }
+            lane_scores.push_back(chunk_scores);
+            lane_bwd.push_back(chunk_bwd);
+            lane_posts.push_back(chunk_posts);
+        }
+        if (!decode_lanes) {
+            continue;
+        }
+
+        auto decode_results = beam_search_decode_lanes(
+                lane_scores, lane_bwd, lane_posts, options.beam_width, options.beam_cut,
+                options.blank_score, options.q_shift, options.q_scale, options.temperature,
+                options.byte_score_scale);
+        for (int l = 0; l < num_lanes; l++) {
+            store_result(t_first_chunk + first_lane_chunk + l, std::move(decode_results[l]));
+        }
+    }
 }
 
 std::vector<DecodedChunk> beam_search_cpu(const torch::Tensor& scores,
                                                   const int num_chunks,
                                                   const DecoderOptions& options,
                                                   std::string &device) {
-    const auto scores_cpu = scores.to(torch::kCPU).transpose(0, 1);
-    int num_threads = std::min(num_chunks, 4);
-    int chunks_per_thread = num_chunks / num_threads;
-    int num_threads_with_one_more_chunk = num_chunks % num_threads;
-
     std::vector<DecodedChunk> chunk_results(num_chunks);
 
-    std::vector<std::unique_ptr<std::thread>> threads;
-    threads.reserve(num_threads);
-    for (int i = 0; i < num_threads; ++i) {
-        threads.emplace_back(new std::thread(
-                [&](int i) {
-                    int t_first_chunk =
-                            i * chunks_per_thread + std::min(i, num_threads_with_one_more_chunk);
-                    int t_num_chunks = chunks_per_thread + int(i < num_threads_with_one_more_chunk);
-
-                    using Slice = torch::indexing::Slice;
-                    auto t_scores = scores_cpu.index(
-                            {Slice(), Slice(t_first_chunk, t_first_chunk + t_num_chunks)});
-
-                    torch::Tensor fwd = forward_scores(t_scores, options.blank_score);
-                    torch::Tensor bwd = backward_scores(t_scores, options.blank_score);
-
-                    torch::Tensor posts = torch::softmax(fwd + bwd, -1);
-
-                    t_scores = t_scores.transpose(0, 1);
-                    bwd = bwd.transpose(0, 1).contiguous();
-                    posts = posts.transpose(0, 1).contiguous();
-
-                    for (int i = 0; i < t_num_chunks; i++) {
-                        auto decode_result = beam_search_decode(
-                                t_scores[i], bwd[i], posts[i], options.beam_width, options.beam_cut,
-                                options.blank_score, options.q_shift, options.q_scale,
-                                options.temperature, 1.0f);
-                        chunk_results[t_first_chunk + i] = DecodedChunk{
-                                std::get<0>(decode_result),
-                                std::get<1>(decode_result),
-                                std::get<2>(decode_result),
-                        };
-                    }
-                },
-                i));
-    }
-
-    for (auto& thread : threads) {
-        thread->join();
+    // chunks are decoded in groups, one pool task per group
+    DecodeTask task;
+    task.scores_cpu = scores.to(torch::kCPU);
+    if (task.scores_cpu.scalar_type() != torch::kInt8) {
+        task.scores_cpu = task.scores_cpu.to(torch::kFloat32);
     }
+    task.scores_cpu = task.scores_cpu.contiguous();
+    task.options = &options;
+    task.chunk_results = &chunk_results;
+    task.num_tasks = std::max(1, std::min(num_chunks, options.num_threads));
+    task.chunks_per_task = num_chunks / task.num_tasks;
+    task.num_tasks_with_one_more_chunk = num_chunks % task.num_tasks;
+
+    thread_pool_run(options.pool, task.num_tasks, decode_task, &task);
 
     return chunk_results;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "thread.h"
 #include <torch/torch.h>
 
 #include <string>
@@ -19,6 +20,10 @@ struct DecoderOptions {
     float q_scale = 1.0;
     float temperature = 1.0;
     bool move_pad = false;
+    thread_pool_t *pool = nullptr; // decode on the calling thread if not set
+    int num_threads = 4;            // number of chunk groups decoded in parallel
+    bool viterbi = false;           // single best path instead of beam search (CPU decoding only)
+    float byte_score_scale = 1.0;   // value of one step of int8 scores
 };
 
 class Decoder {
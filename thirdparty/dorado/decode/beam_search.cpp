@@ -10,31 +10,12 @@
 #include <iostream>
 #include <limits>
 #include <numeric>
+#include <utility>
 
 //#define REMOVE_FIXED_BEAM_STAYS
 
-// 16 bit state supports 7-mers with 4 bases.
-typedef int16_t state_t;
-
 const int num_bases = 4;
 
-// This is the data we need to retain for the whole beam
-struct BeamElement {
-    state_t state;
-    uint8_t prev_element_index;
-    bool stay;
-};
-
-// This is the data we need to retain for only the previous timestep (block) in the beam
-//  (and what we construct for the new timestep)
-struct BeamFrontElement {
-    uint64_t hash;
-    float score;
-    state_t state;
-    uint8_t prev_element_index;
-    bool stay;
-};
-
 float log_sum_exp(float x, float y, float t) {
     float abs_diff = fabsf(x - y) / t;
     return fmaxf(x, y) + ((abs_diff < 17.0f) ? (log1pf(expf(-abs_diff)) * t) : 0.0f);
@@ -42,6 +23,18 @@ float log_sum_exp(float x, float y, float t) {
 
 bool score_sort(const BeamFrontElement& a, const BeamFrontElement& b) { return a.score > b.score; }
 
+// Size of the step hash table for num_steps steps: a power of two, at most half full
+static size_t step_table_size(size_t num_steps) {
+    size_t size = 16;
+    while (size < 2 * num_steps) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Home slot of a hash in the step table (to be masked to the table size)
+static inline size_t step_table_slot(uint64_t hash) { return size_t(hash ^ (hash >> 32)); }
+
 int get_num_states(size_t num_trans_states) {
 #ifdef REMOVE_FIXED_BEAM_STAYS
     if (num_trans_states % num_bases != 0) {
@@ -56,63 +49,188 @@ int get_num_states(size_t num_trans_states) {
 #endif
 }
 
-std::tuple<std::string, std::string> generate_sequence(const std::vector<uint8_t>& moves,
-                                                       const std::vector<int32_t>& states,
-                                                       const std::vector<float>& qual_data,
-                                                       float shift,
-                                                       float scale) {
-    size_t seqPos = 0;
-    size_t num_blocks = moves.size();
-    size_t seqLen = accumulate(moves.begin(), moves.end(), 0);
+DecoderWorkspace& decoder_workspace() {
+    static thread_local DecoderWorkspace workspace;
+    return workspace;
+}
+
+// The qstring character of a base with error probability error_prob
+static char qstring_char(float error_prob, float shift, float scale) {
+    float qscore = -10.0f * log10f(error_prob) * scale + shift;
+    qscore = std::min(90.0f, qscore);
+    qscore = std::max(1.0f, qscore);
+    return char(33.5f + qscore);
+}
 
-    std::string sequence(seqLen, 'N');
-    std::string qstring(seqLen, '!');
-    std::array<char, 4> alphabet = {'A', 'C', 'G', 'T'};
-    std::vector<float> baseProbs(seqLen), totalProbs(seqLen);
+// The qstring table holds the character of the error probabilities in [0, 1] by the top bits of
+// their float representation, the 7 most significant bits of the mantissa being the last. The
+// character rarely changes within the range of an entry, and the entries where it does are 0 (no
+// character is), for those error probabilities to go through qstring_char.
+static const int qstring_table_shift_bits = 16;
 
-    for (size_t blk = 0; blk < num_blocks; ++blk) {
-        int state = states[blk];
-        int move = int(moves[blk]);
-        int base = state & 3;
-        int offset = (blk == 0) ? 0 : move - 1;
-        int probPos = int(seqPos) + offset;
+static uint32_t float_bits(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
 
-        // Get the probability for the called base.
-        baseProbs[probPos] += qual_data[blk * alphabet.size() + base];
+static float bits_float(uint32_t bits) {
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
 
-        // Accumulate the total probability for all possible bases at this position, for normalization.
-        for (size_t k = 0; k < alphabet.size(); ++k) {
-            totalProbs[probPos] += qual_data[blk * alphabet.size() + k];
-        }
+// The qstring table for shift and scale, kept in the workspace until they change
+static const std::vector<char>& qstring_table(float shift, float scale,
+                                              DecoderWorkspace& workspace) {
+    std::vector<char>& table = workspace.qstring_table;
+    if (!table.empty() && workspace.qstring_table_shift == shift &&
+        workspace.qstring_table_scale == scale) {
+        return table;
+    }
+    // The qstring character only ever goes one way as the error probability increases, so an
+    // entry has a single character if its lowest and highest error probabilities do
+    const uint32_t one_bits = float_bits(1.0f);
+    const uint32_t entry_mask = (1u << qstring_table_shift_bits) - 1;
+    table.resize((one_bits >> qstring_table_shift_bits) + 1);
+    for (uint32_t entry = 0; entry < table.size(); entry++) {
+        const uint32_t low_bits = entry << qstring_table_shift_bits;
+        const uint32_t high_bits = std::min(one_bits, low_bits | entry_mask);
+        const char low_char = qstring_char(bits_float(low_bits), shift, scale);
+        const char high_char = qstring_char(bits_float(high_bits), shift, scale);
+        table[entry] = (low_char == high_char) ? low_char : 0;
+    }
+    workspace.qstring_table_shift = shift;
+    workspace.qstring_table_scale = scale;
+    return table;
+}
 
-        if (blk == 0) {
-            sequence[seqPos++] = char(base);
-        } else {
-            for (int j = 0; j < move; ++j) {
-                sequence[seqPos++] = char(base);
+// Writes the bases of the path given by moves and states into sequence and their qstring into
+// qstring. The probabilities of each base are those of the block emitting it and of the stays
+// following, so its qstring character is written once the next base is emitted.
+void generate_sequence(const std::vector<uint8_t>& moves,
+                       const std::vector<int32_t>& states,
+                       const std::vector<float>& qual_data,
+                       float shift,
+                       float scale,
+                       DecoderWorkspace& workspace,
+                       std::string& sequence,
+                       std::string& qstring) {
+    const size_t num_blocks = moves.size();
+    const size_t seq_len = accumulate(moves.begin(), moves.end(), 0);
+    static const char alphabet[num_bases] = {'A', 'C', 'G', 'T'};
+    const std::vector<char>& table = qstring_table(shift, scale, workspace);
+    const uint32_t one_bits = float_bits(1.0f);
+
+    sequence.resize(seq_len);
+    qstring.resize(seq_len);
+    char* const seq_out = &sequence[0];
+    char* const qstring_out = &qstring[0];
+    const auto write_qstring = [&](size_t seq_pos, float base_prob, float total_prob) {
+        const float error_prob = 1.0f - (base_prob / total_prob);
+        // Rounding may leave the error probability a little below 0, and bases with no
+        // probabilities give NaN: neither is in the table
+        const uint32_t bits = float_bits(error_prob);
+        const char c = (bits <= one_bits) ? table[bits >> qstring_table_shift_bits] : 0;
+        qstring_out[seq_pos] = c ? c : qstring_char(error_prob, shift, scale);
+    };
+
+    size_t seq_pos = 0;
+    float base_prob = 0.0f;
+    float total_prob = 0.0f;
+    for (size_t blk = 0; blk < num_blocks; ++blk) {
+        const int base = states[blk] & 3;
+        const int move = (blk == 0) ? 1 : int(moves[blk]);
+        if (move > 0) {
+            if (seq_pos > 0) {
+                write_qstring(seq_pos - 1, base_prob, total_prob);
+            }
+            // The bases stepped over by a move of more than one have no probabilities
+            for (int j = 1; j < move; ++j) {
+                seq_out[seq_pos] = alphabet[base];
+                write_qstring(seq_pos++, 0.0f, 0.0f);
             }
+            seq_out[seq_pos++] = alphabet[base];
+            base_prob = 0.0f;
+            total_prob = 0.0f;
+        }
+
+        // The probability of the called base, and the total probability of all the bases at
+        // this position for normalization
+        const float* const block_qual = &qual_data[blk * num_bases];
+        base_prob += block_qual[base];
+        for (int k = 0; k < num_bases; ++k) {
+            total_prob += block_qual[k];
         }
     }
+    if (seq_pos > 0) {
+        write_qstring(seq_pos - 1, base_prob, total_prob);
+    }
+}
+
+// Per-base probabilities of each block of a decoded path from the posterior state probabilities
+// (states are reduced to the emitted base)
+static void compute_qual_data(std::vector<int32_t>& states,
+                              const float* const posts,
+                              size_t num_states,
+                              size_t num_blocks,
+                              std::vector<float>& qual_data) {
+    int hp_states[4] = {0, 0, 0,
+                        0};  // What state index are the four homopolymers (A is always state 0)
+    hp_states[3] = int(num_states) - 1;  // homopolymer T is always the last state. (11b per base)
+    hp_states[1] = hp_states[3] / 3;     // calculate hp C from hp T (01b per base)
+    hp_states[2] = hp_states[1] * 2;     // calculate hp G from hp C (10b per base)
 
-    for (size_t i = 0; i < seqLen; ++i) {
-        sequence[i] = alphabet[int(sequence[i])];
-        baseProbs[i] = 1.0f - (baseProbs[i] / totalProbs[i]);
-        baseProbs[i] = -10.0f * log10f(baseProbs[i]);
-        float qscore = baseProbs[i] * scale + shift;
-        qscore = std::min(90.0f, qscore);
-        qscore = std::max(1.0f, qscore);
-        qstring[i] = char(33.5f + qscore);
+    // Compute per-base qual data
+    for (size_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+        int state = states[block_idx];
+        states[block_idx] = states[block_idx] % num_bases;
+        int base_to_emit = states[block_idx];
+
+        // Compute a probability for this block, based on the path kmer. See the following explanation:
+        // https://git.oxfordnanolabs.local/machine-learning/notebooks/-/blob/master/bonito-basecaller-qscores.ipynb
+        const float* timestep_posts = posts + ((block_idx + 1) * num_states);
+
+        // For states which are homopolymers, we don't want to count the states more than once
+        bool is_hp = state == hp_states[0] || state == hp_states[1] || state == hp_states[2] ||
+                     state == hp_states[3];
+        float block_prob = float(timestep_posts[state]) * (is_hp ? -1.0f : 1.0f);
+
+        // Add in left-shifted kmers
+        int l_shift_idx = state / num_bases;
+        int msb = int(num_states) / num_bases;
+        for (int shift_base = 0; shift_base < num_bases; shift_base++) {
+            block_prob += float(timestep_posts[l_shift_idx + msb * shift_base]);
+        }
+
+        // Add in the right-shifted kmers
+        int r_shift_idx = (state * num_bases) % num_states;
+        for (int shift_base = 0; shift_base < num_bases; shift_base++) {
+            block_prob += float(timestep_posts[r_shift_idx + shift_base]);
+        }
+        if (block_prob < 0.0f) block_prob = 0.0f;
+        else if (block_prob > 1.0f) block_prob = 1.0f;\
+        block_prob = powf(block_prob, 0.4f);  // Power fudge factor
+
+        // Calculate a placeholder qscore for the "wrong" bases
+        float wrong_base_prob = (1.0f - block_prob) / 3.0f;
+
+        for (size_t base = 0; base < num_bases; base++) {
+            qual_data[block_idx * num_bases + base] =
+                    (int(base) == base_to_emit ? block_prob : wrong_base_prob);
+        }
     }
 
-    return make_tuple(sequence, qstring);
 }
 
-template <typename T>
+// kNumStates, when not 0, fixes the number of states at compile time (it must then match the
+// num_states argument), so that the modulo by the number of states becomes a mask.
+template <typename T, size_t kNumStates = 0>
 float beam_search(const T* const scores,
                   size_t scores_block_stride,
                   const float* const back_guide,
                   const float* const posts,
-                  size_t num_states,
+                  size_t num_states_arg,
                   size_t num_blocks,
                   size_t max_beam_width,
                   float beam_cut,
@@ -121,7 +239,9 @@ float beam_search(const T* const scores,
                   std::vector<uint8_t>& moves,
                   std::vector<float>& qual_data,
                   float temperature,
-                  float score_scale) {
+                  float score_scale,
+                  DecoderWorkspace& workspace) {
+    const size_t num_states = kNumStates ? kNumStates : num_states_arg;
     if (max_beam_width > 256) {
         throw std::range_error("Beamsearch max_beam_width cannot be greater than 256.");
     }
@@ -131,29 +251,36 @@ float beam_search(const T* const scores,
     const float log_beam_cut =
             (beam_cut > 0.0f) ? (temperature * logf(beam_cut)) : std::numeric_limits<float>::max();
 
-    // Create the beam.  We need to keep beam_width elements for each block, plus the initial state
-    std::vector<BeamElement> beam_vector(max_beam_width * (num_blocks + 1));
+    // The beam.  We need to keep beam_width elements for each block, plus the initial state
+    std::vector<BeamElement>& beam_vector = workspace.beam_vector;
+    beam_vector.resize(max_beam_width * (num_blocks + 1));
 
-    // Create the previous and current beam fronts
+    // The previous and current beam fronts
     // Each existing element can be extended by one of num_bases, or be a stay.
     size_t max_beam_candidates = (num_bases + 1) * max_beam_width;
 
-    std::vector<BeamFrontElement> beam_front_vector_1(max_beam_candidates);
-    std::vector<BeamFrontElement> beam_front_vector_2(max_beam_candidates);
-    std::vector<BeamFrontElement>* current_beam_front = &beam_front_vector_1;
-    std::vector<BeamFrontElement>* prev_beam_front = &beam_front_vector_2;
+    workspace.beam_front_1.resize(max_beam_candidates);
+    workspace.beam_front_2.resize(max_beam_candidates);
+    std::vector<BeamFrontElement>* current_beam_front = &workspace.beam_front_1;
+    std::vector<BeamFrontElement>* prev_beam_front = &workspace.beam_front_2;
+
+    // Open-addressing table of the step candidates of a block, keyed on their hashes
+    std::vector<int16_t>& step_table = workspace.step_table;
+    step_table.resize(step_table_size(num_bases * max_beam_width));
 
     // Find the score an initial element needs in order to make it into the beam
-    T beam_init_threshold = std::numeric_limits<T>::lowest();
+    // (the back guides are floats whatever the type of the scores)
+    float beam_init_threshold = std::numeric_limits<float>::lowest();
     if (max_beam_width < num_states) {
         // Copy the first set of back guides and sort to extract max_beam_width highest elements
-        std::vector<T> sorted_back_guides(num_states);
-        memcpy(sorted_back_guides.data(), back_guide, num_states * sizeof(T));
+        std::vector<float>& sorted_back_guides = workspace.sorted_back_guides;
+        sorted_back_guides.resize(num_states);
+        memcpy(sorted_back_guides.data(), back_guide, num_states * sizeof(float));
 
         // Note we don't need a full sort here to get the max_beam_width highest values
         std::nth_element(sorted_back_guides.begin(),
                          sorted_back_guides.begin() + max_beam_width - 1, sorted_back_guides.end(),
-                         std::greater<T>());
+                         std::greater<float>());
         beam_init_threshold = sorted_back_guides[max_beam_width - 1];
     }
 
@@ -268,38 +395,48 @@ float beam_search(const T* const scores,
                                                        (uint8_t)prev_elem_idx, true};
         }
 
-        // For each new stay, see if any steps result in the same sequence hash, and merge if so
+        // For each new stay, see if any steps result in the same sequence hash, and merge if so.
+        // The steps are looked up in a hash table rather than compared with every stay, so the
+        // merge is linear in the beam width. With linear probing, steps with the same hash are
+        // found in the order they were added, so the merges happen in the same order as with a
+        // scan over the steps.
+        const size_t num_steps = num_bases * current_beam_width;
+        const size_t table_mask = step_table_size(num_steps) - 1;
+        std::fill(step_table.begin(), step_table.begin() + table_mask + 1, int16_t(-1));
+        for (size_t step_elem_idx = 0; step_elem_idx < num_steps; step_elem_idx++) {
+            size_t slot = step_table_slot((*current_beam_front)[step_elem_idx].hash) & table_mask;
+            while (step_table[slot] >= 0) {
+                slot = (slot + 1) & table_mask;
+            }
+            step_table[slot] = int16_t(step_elem_idx);
+        }
+
         for (size_t prev_elem_idx = 0; prev_elem_idx < current_beam_width; prev_elem_idx++) {
             // The index of the stay in the beamfront
-            size_t stay_elem_idx = num_bases * current_beam_width + prev_elem_idx;
+            size_t stay_elem_idx = num_steps + prev_elem_idx;
+            auto& stay_elem = (*current_beam_front)[stay_elem_idx];
             // latest base is in smallest bits
-            int stay_latest_base = int((*current_beam_front)[stay_elem_idx].state % num_bases);
-
-            // Go through all the possible step extensions that match this destination base with the stay and compare
-            //  their hashes, merging if we find any
-            for (size_t prev_elem_comp_idx = 0; prev_elem_comp_idx < current_beam_width;
-                 prev_elem_comp_idx++) {
-                size_t step_elem_idx = prev_elem_comp_idx * num_bases + stay_latest_base;
-                if ((*current_beam_front)[stay_elem_idx].hash ==
-                    (*current_beam_front)[step_elem_idx].hash) {
-                    if ((*current_beam_front)[stay_elem_idx].score >
-                        (*current_beam_front)[step_elem_idx].score) {
-                        // Fold the step into the stay
-                        (*current_beam_front)[stay_elem_idx].score = log_sum_exp(
-                                (*current_beam_front)[stay_elem_idx].score,
-                                (*current_beam_front)[step_elem_idx].score, temperature);
-                        // The step element will end up last, sorted by score
-                        (*current_beam_front)[step_elem_idx].score =
-                                -std::numeric_limits<float>::max();
-                    } else {
-                        // Fold the stay into the step
-                        (*current_beam_front)[step_elem_idx].score = log_sum_exp(
-                                (*current_beam_front)[stay_elem_idx].score,
-                                (*current_beam_front)[step_elem_idx].score, temperature);
-                        // The stay element will end up last, sorted by score
-                        (*current_beam_front)[stay_elem_idx].score =
-                                -std::numeric_limits<float>::max();
-                    }
+            int stay_latest_base = int(stay_elem.state % num_bases);
+
+            // Go through the steps with the hash of the stay that match its destination base,
+            // merging if we find any
+            for (size_t slot = step_table_slot(stay_elem.hash) & table_mask; step_table[slot] >= 0;
+                 slot = (slot + 1) & table_mask) {
+                auto& step_elem = (*current_beam_front)[step_table[slot]];
+                if (step_elem.hash != stay_elem.hash ||
+                    int(step_elem.state % num_bases) != stay_latest_base) {
+                    continue;
+                }
+                if (stay_elem.score > step_elem.score) {
+                    // Fold the step into the stay
+                    stay_elem.score = log_sum_exp(stay_elem.score, step_elem.score, temperature);
+                    // The step element will end up last, sorted by score
+                    step_elem.score = -std::numeric_limits<float>::max();
+                } else {
+                    // Fold the stay into the step
+                    step_elem.score = log_sum_exp(stay_elem.score, step_elem.score, temperature);
+                    // The stay element will end up last, sorted by score
+                    stay_elem.score = -std::numeric_limits<float>::max();
                 }
             }
         }
@@ -413,53 +550,25 @@ float beam_search(const T* const scores,
     }
     moves[0] = 1;  // Always step in the first event
 
-    int hp_states[4] = {0, 0, 0,
-                        0};  // What state index are the four homopolymers (A is always state 0)
-    hp_states[3] = int(num_states) - 1;  // homopolymer T is always the last state. (11b per base)
-    hp_states[1] = hp_states[3] / 3;     // calculate hp C from hp T (01b per base)
-    hp_states[2] = hp_states[1] * 2;     // calculate hp G from hp C (10b per base)
-
-    // Compute per-base qual data
-    for (size_t block_idx = 0; block_idx < num_blocks; block_idx++) {
-        int state = states[block_idx];
-        states[block_idx] = states[block_idx] % num_bases;
-        int base_to_emit = states[block_idx];
-
-        // Compute a probability for this block, based on the path kmer. See the following explanation:
-        // https://git.oxfordnanolabs.local/machine-learning/notebooks/-/blob/master/bonito-basecaller-qscores.ipynb
-        const float* timestep_posts = posts + ((block_idx + 1) * num_states);
-
-        // For states which are homopolymers, we don't want to count the states more than once
-        bool is_hp = state == hp_states[0] || state == hp_states[1] || state == hp_states[2] ||
-                     state == hp_states[3];
-        float block_prob = float(timestep_posts[state]) * (is_hp ? -1.0f : 1.0f);
+    compute_qual_data(states, posts, num_states, num_blocks, qual_data);
 
-        // Add in left-shifted kmers
-        int l_shift_idx = state / num_bases;
-        int msb = int(num_states) / num_bases;
-        for (int shift_base = 0; shift_base < num_bases; shift_base++) {
-            block_prob += float(timestep_posts[l_shift_idx + msb * shift_base]);
-        }
-
-        // Add in the right-shifted kmers
-        int r_shift_idx = (state * num_bases) % num_states;
-        for (int shift_base = 0; shift_base < num_bases; shift_base++) {
-            block_prob += float(timestep_posts[r_shift_idx + shift_base]);
-        }
-        if (block_prob < 0.0f) block_prob = 0.0f;
-        else if (block_prob > 1.0f) block_prob = 1.0f;\
-        block_prob = powf(block_prob, 0.4f);  // Power fudge factor
-
-        // Calculate a placeholder qscore for the "wrong" bases
-        float wrong_base_prob = (1.0f - block_prob) / 3.0f;
+    return final_score;
+}
 
-        for (size_t base = 0; base < num_bases; base++) {
-            qual_data[block_idx * num_bases + base] =
-                    (int(base) == base_to_emit ? block_prob : wrong_base_prob);
-        }
+// beam_search specialised for the common model sizes (state_len 3, 4 and 5), with the generic
+// version for the others. The arguments are those of beam_search.
+template <typename T, typename... Args>
+static float beam_search_specialised(size_t num_states, Args&&... args) {
+    switch (num_states) {
+    case 64:
+        return beam_search<T, 64>(std::forward<Args>(args)...);
+    case 256:
+        return beam_search<T, 256>(std::forward<Args>(args)...);
+    case 1024:
+        return beam_search<T, 1024>(std::forward<Args>(args)...);
+    default:
+        return beam_search<T>(std::forward<Args>(args)...);
     }
-
-    return final_score;
 }
 
 std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
@@ -476,10 +585,13 @@ std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
     const int num_blocks = int(scores_t.size(0));
     const int num_states = get_num_states(scores_t.size(1));
 
+    DecoderWorkspace& workspace = decoder_workspace();
     std::string sequence, qstring;
-    std::vector<int32_t> states(num_blocks);
+    std::vector<int32_t>& states = workspace.states;
     std::vector<uint8_t> moves(num_blocks);
-    std::vector<float> qual_data(num_blocks * num_bases);
+    std::vector<float>& qual_data = workspace.qual_data;
+    states.resize(num_blocks);
+    qual_data.resize(num_blocks * num_bases);
 
     // Posterior probabilities and back guides must be floats regardless of scores type.
     if (posts_t.dtype() != torch::kFloat32 || back_guides_t.dtype() != torch::kFloat32) {
@@ -499,23 +611,561 @@ std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
         const auto back_guides = back_guides_contig->data_ptr<float>();
         const auto posts = posts_contig->data_ptr<float>();
 
-        beam_search<float>(scores, scores_block_stride, back_guides, posts, num_states, num_blocks,
-                           beam_width, beam_cut, fixed_stay_score, states, moves, qual_data,
-                           temperature, 1.0f);
+        beam_search_specialised<float>(num_states, scores, scores_block_stride, back_guides, posts,
+                                       num_states, num_blocks, beam_width, beam_cut,
+                                       fixed_stay_score, states, moves, qual_data, temperature,
+                                       1.0f, workspace);
     } else if (scores_t.dtype() == torch::kInt8) {
         const auto scores = scores_block_contig.data_ptr<int8_t>();
         const auto back_guides = back_guides_contig->data_ptr<float>();
         const auto posts = posts_contig->data_ptr<float>();
 
-        beam_search<int8_t>(scores, scores_block_stride, back_guides, posts, num_states, num_blocks,
-                            beam_width, beam_cut, fixed_stay_score, states, moves, qual_data,
-                            temperature, byte_score_scale);
+        beam_search_specialised<int8_t>(num_states, scores, scores_block_stride, back_guides, posts,
+                                        num_states, num_blocks, beam_width, beam_cut,
+                                        fixed_stay_score, states, moves, qual_data, temperature,
+                                        byte_score_scale, workspace);
     } else {
         throw std::runtime_error(std::string("beam_search_decode: unsupported tensor type ") +
                                  std::string(scores_t.dtype().name()));
     }
 
-    std::tie(sequence, qstring) = generate_sequence(moves, states, qual_data, q_shift, q_scale);
+    generate_sequence(moves, states, qual_data, q_shift, q_scale, workspace, sequence, qstring);
+
+    return std::make_tuple(std::move(sequence), std::move(qstring), std::move(moves));
+}
+
+// beam_search on num_lanes chunks at once, lane l reading scores[l] and back_guides[l]. The beam
+// fronts are padded to the widest beam of all lanes with NaN score elements, which never compare
+// greater or equal to anything, so they are never counted, kept or merged and each lane goes
+// through the same steps as beam_search on its own. Only the state paths are produced, into
+// states[l] and moves[l]. kNumStates and kBeamWidth, when not 0, fix the number of states and the
+// beam width at compile time (they must then match the num_states and max_beam_width arguments),
+// so that the modulo by the number of states becomes a mask and the candidate loops can be
+// unrolled.
+template <typename T, size_t kNumStates = 0, size_t kBeamWidth = 0>
+void beam_search_lanes(const T* const* scores,
+                       size_t scores_block_stride,
+                       const float* const* back_guides,
+                       size_t num_lanes,
+                       size_t num_states_arg,
+                       size_t num_blocks,
+                       size_t max_beam_width_arg,
+                       float beam_cut,
+                       float fixed_stay_score,
+                       std::vector<int32_t>* states,
+                       std::vector<uint8_t>* moves,
+                       float temperature,
+                       float score_scale,
+                       DecoderWorkspace& workspace) {
+    constexpr size_t L = beam_search_max_lanes;
+    const size_t num_states = kNumStates ? kNumStates : num_states_arg;
+    const size_t max_beam_width = kBeamWidth ? kBeamWidth : max_beam_width_arg;
+    if (max_beam_width > 256) {
+        throw std::range_error("Beamsearch max_beam_width cannot be greater than 256.");
+    }
+    if (num_lanes < 1 || num_lanes > L) {
+        throw std::range_error("Beamsearch lanes must be between 1 and beam_search_max_lanes.");
+    }
+
+    constexpr uint64_t hash_seed = 0x880355f21e6d1965ULL;
+    const float log_beam_cut =
+            (beam_cut > 0.0f) ? (temperature * logf(beam_cut)) : std::numeric_limits<float>::max();
+    const float padding_score = std::numeric_limits<float>::quiet_NaN();
+
+    // The beam of each lane, one after the other
+    const size_t lane_beam_size = max_beam_width * (num_blocks + 1);
+    std::vector<BeamElement>& beam_vector = workspace.lane_beam_vector;
+    beam_vector.resize(L * lane_beam_size);
+
+    const size_t max_beam_candidates = (num_bases + 1) * max_beam_width;
+    workspace.lane_front_1.resize(max_beam_candidates);
+    workspace.lane_front_2.resize(max_beam_candidates);
+
+    // The fields of the fronts as plain pointers, which the stores to the uint8_t fields can't be
+    // taken to alias
+    uint64_t* const cur_hash = workspace.lane_front_1.hash.data();
+    float* const cur_score = workspace.lane_front_1.score.data();
+    state_t* const cur_state = workspace.lane_front_1.state.data();
+    uint8_t* const cur_prev_index = workspace.lane_front_1.prev_element_index.data();
+    uint8_t* const cur_stay = workspace.lane_front_1.stay.data();
+    uint64_t* const prev_hash = workspace.lane_front_2.hash.data();
+    float* const prev_score = workspace.lane_front_2.score.data();
+    state_t* const prev_state = workspace.lane_front_2.state.data();
+
+    std::vector<int16_t>& step_table = workspace.step_table;
+    step_table.resize(step_table_size(num_bases * max_beam_width));
+
+    // The unused lanes decode the first chunk, with nothing but padding in their beams
+    const T* block_scores[L];
+    const float* block_back_scores[L];
+    size_t beam_width[L];
+
+    // Pads the elements of each lane beyond its beam width up to the widest beam
+    const auto pad_front = [&](size_t common_width) {
+        for (size_t l = 0; l < L; l++) {
+            for (size_t elem_idx = beam_width[l]; elem_idx < common_width; elem_idx++) {
+                prev_hash[elem_idx * L + l] = 0;
+                prev_score[elem_idx * L + l] = padding_score;
+                prev_state[elem_idx * L + l] = 0;
+            }
+        }
+    };
+
+    // Initialise the beam of each lane
+    for (size_t l = 0; l < L; l++) {
+        beam_width[l] = 0;
+        if (l >= num_lanes) {
+            continue;
+        }
+        const float* const back_guide = back_guides[l];
+        float beam_init_threshold = std::numeric_limits<float>::lowest();
+        if (max_beam_width < num_states) {
+            std::vector<float>& sorted_back_guides = workspace.sorted_back_guides;
+            sorted_back_guides.resize(num_states);
+            memcpy(sorted_back_guides.data(), back_guide, num_states * sizeof(float));
+            std::nth_element(sorted_back_guides.begin(),
+                             sorted_back_guides.begin() + max_beam_width - 1,
+                             sorted_back_guides.end(), std::greater<float>());
+            beam_init_threshold = sorted_back_guides[max_beam_width - 1];
+        }
+        for (size_t state = 0, beam_element = 0;
+             state < num_states && beam_element < max_beam_width; state++) {
+            if (back_guide[state] >= beam_init_threshold) {
+                const size_t i = beam_element * L + l;
+                prev_hash[i] = chainfasthash64(hash_seed, state);
+                prev_score[i] = 0.0f;
+                prev_state[i] = state_t(state);
+                beam_vector[l * lane_beam_size + beam_element++] = {state_t(state), 0, false};
+            }
+        }
+        beam_width[l] = std::min(max_beam_width, num_states);
+    }
+    size_t common_width = *std::max_element(beam_width, beam_width + L);
+    pad_front(common_width);
+
+    for (size_t block_idx = 0; block_idx < num_blocks; block_idx++) {
+        for (size_t l = 0; l < L; l++) {
+            const size_t lane = (l < num_lanes) ? l : 0;
+            block_scores[l] = scores[lane] + block_idx * scores_block_stride;
+            block_back_scores[l] = back_guides[lane] + (block_idx + 1) * num_states;
+        }
+
+        // Candidates: the steps of element e are at e * num_bases + base, its stay at
+        // num_bases * common_width + e, in the order of beam_search
+        const size_t num_steps = num_bases * common_width;
+        const size_t new_elem_count = num_steps + common_width;
+        for (size_t prev_elem_idx = 0; prev_elem_idx < common_width; prev_elem_idx++) {
+            for (size_t l = 0; l < L; l++) {
+                const size_t i = prev_elem_idx * L + l;
+                const state_t state = prev_state[i];
+                const float score = prev_score[i];
+                const uint64_t hash = prev_hash[i];
+                const T* const lane_scores = block_scores[l];
+                const float* const lane_back_scores = block_back_scores[l];
+                for (size_t new_base = 0; new_base < num_bases; new_base++) {
+                    const state_t new_state = state_t((state * num_bases) % num_states + new_base);
+#ifdef REMOVE_FIXED_BEAM_STAYS
+                    const size_t move_idx =
+                            new_state * num_bases + (state * num_bases) / num_states;
+#else
+                    const size_t move_idx = new_state * (num_bases + 1) +
+                                            (1 + (state * num_bases) / num_states);
+#endif
+                    const size_t o = (prev_elem_idx * num_bases + new_base) * L + l;
+                    cur_score[o] = score + static_cast<float>(lane_scores[move_idx]) * score_scale +
+                                   lane_back_scores[new_state];
+                    cur_hash[o] = chainfasthash64(hash, new_state);
+                    cur_state[o] = new_state;
+                }
+#ifdef REMOVE_FIXED_BEAM_STAYS
+                const float stay_score = score + fixed_stay_score + lane_back_scores[state];
+#else
+                const float stay_score =
+                        score +
+                        static_cast<float>(lane_scores[state * (num_bases + 1)]) * score_scale +
+                        lane_back_scores[state];
+#endif
+                const size_t o = (num_steps + prev_elem_idx) * L + l;
+                cur_score[o] = stay_score;
+                cur_hash[o] = hash;
+                cur_state[o] = state;
+            }
+            memset(&cur_prev_index[prev_elem_idx * num_bases * L], int(prev_elem_idx),
+                   num_bases * L);
+            memset(&cur_stay[prev_elem_idx * num_bases * L], 0, num_bases * L);
+            memset(&cur_prev_index[(num_steps + prev_elem_idx) * L], int(prev_elem_idx), L);
+            memset(&cur_stay[(num_steps + prev_elem_idx) * L], 1, L);
+        }
+
+        // Merge the stays and steps with the same hash, lane by lane as in beam_search
+        for (size_t l = 0; l < num_lanes; l++) {
+            const size_t lane_steps = num_bases * beam_width[l];
+            const size_t table_mask = step_table_size(lane_steps) - 1;
+            std::fill(step_table.begin(), step_table.begin() + table_mask + 1, int16_t(-1));
+            for (size_t step_elem_idx = 0; step_elem_idx < lane_steps; step_elem_idx++) {
+                size_t slot = step_table_slot(cur_hash[step_elem_idx * L + l]) & table_mask;
+                while (step_table[slot] >= 0) {
+                    slot = (slot + 1) & table_mask;
+                }
+                step_table[slot] = int16_t(step_elem_idx);
+            }
+            for (size_t prev_elem_idx = 0; prev_elem_idx < beam_width[l]; prev_elem_idx++) {
+                const size_t stay = (num_steps + prev_elem_idx) * L + l;
+                const uint64_t stay_hash = cur_hash[stay];
+                const int stay_latest_base = int(cur_state[stay] % num_bases);
+                for (size_t slot = step_table_slot(stay_hash) & table_mask; step_table[slot] >= 0;
+                     slot = (slot + 1) & table_mask) {
+                    const size_t step = step_table[slot] * L + l;
+                    if (cur_hash[step] != stay_hash ||
+                        int(cur_state[step] % num_bases) != stay_latest_base) {
+                        continue;
+                    }
+                    float& stay_score = cur_score[stay];
+                    float& step_score = cur_score[step];
+                    if (stay_score > step_score) {
+                        stay_score = log_sum_exp(stay_score, step_score, temperature);
+                        step_score = -std::numeric_limits<float>::max();
+                    } else {
+                        step_score = log_sum_exp(stay_score, step_score, temperature);
+                        stay_score = -std::numeric_limits<float>::max();
+                    }
+                }
+            }
+        }
+
+        // Max score and cutoff of each lane, the padding never being greater
+        float max_score[L];
+        float beam_cutoff_score[L];
+        std::fill(max_score, max_score + L, -std::numeric_limits<float>::max());
+        for (size_t elem_idx = 0; elem_idx < new_elem_count; elem_idx++) {
+            for (size_t l = 0; l < L; l++) {
+                const float score = cur_score[elem_idx * L + l];
+                max_score[l] = (score > max_score[l]) ? score : max_score[l];
+            }
+        }
+        for (size_t l = 0; l < L; l++) {
+            beam_cutoff_score[l] = max_score[l] - log_beam_cut;
+        }
+
+        // Counts the elements of each lane which meet its beam score
+        size_t count[L];
+        const auto count_elements = [&]() {
+            int32_t lane_count[L] = {0};
+            for (size_t elem_idx = 0; elem_idx < new_elem_count; elem_idx++) {
+                for (size_t l = 0; l < L; l++) {
+                    lane_count[l] += cur_score[elem_idx * L + l] >= beam_cutoff_score[l];
+                }
+            }
+            for (size_t l = 0; l < L; l++) {
+                count[l] = size_t(lane_count[l]);
+            }
+        };
+        count_elements();
+
+        // The same binary search for a cutoff score as beam_search, for all the lanes which
+        // have too many elements at once
+        size_t elem_count[L];
+        bool searching[L];
+        bool in_search[L];
+        int num_guesses[L];
+        float low_score[L];
+        float hi_score[L];
+        const size_t min_beam_width = (max_beam_width * 8) / 10;
+        static const int MAX_GUESSES = 10;
+        bool any_searching = false;
+        for (size_t l = 0; l < L; l++) {
+            elem_count[l] = count[l];
+            in_search[l] = searching[l] = elem_count[l] > max_beam_width;
+            any_searching |= searching[l];
+            num_guesses[l] = 1;
+            low_score[l] = beam_cutoff_score[l];
+            hi_score[l] = max_score[l];
+        }
+        while (any_searching) {
+            for (size_t l = 0; l < L; l++) {
+                if (!searching[l]) {
+                    continue;
+                }
+                if (elem_count[l] > max_beam_width) {
+                    low_score[l] = beam_cutoff_score[l];
+                    beam_cutoff_score[l] = (beam_cutoff_score[l] + hi_score[l]) / 2.0f;
+                } else {
+                    hi_score[l] = beam_cutoff_score[l];
+                    beam_cutoff_score[l] = (beam_cutoff_score[l] + low_score[l]) / 2.0f;
+                }
+            }
+            count_elements();
+            any_searching = false;
+            for (size_t l = 0; l < L; l++) {
+                if (!searching[l]) {
+                    continue;
+                }
+                elem_count[l] = count[l];
+                num_guesses[l]++;
+                searching[l] = (elem_count[l] > max_beam_width || elem_count[l] < min_beam_width) &&
+                               num_guesses[l] < MAX_GUESSES;
+                any_searching |= searching[l];
+            }
+        }
+        bool any_failed = false;
+        for (size_t l = 0; l < L; l++) {
+            if (in_search[l] && num_guesses[l] == MAX_GUESSES) {
+                beam_cutoff_score[l] = hi_score[l];
+                any_failed = true;
+            }
+        }
+        if (any_failed) {
+            count_elements();
+            for (size_t l = 0; l < L; l++) {
+                if (in_search[l] && num_guesses[l] == MAX_GUESSES) {
+                    elem_count[l] = count[l];
+                }
+            }
+        }
+
+        // Keep the elements meeting the cutoff, in order, removing the backwards contribution
+        // from their scores, and copy them into the beam of their lane
+        const bool last_block = block_idx == num_blocks - 1;
+        for (size_t l = 0; l < num_lanes; l++) {
+            const float cutoff = beam_cutoff_score[l];
+            const float* const lane_back_scores = block_back_scores[l];
+            BeamElement* const beam =
+                    &beam_vector[l * lane_beam_size + (block_idx + 1) * max_beam_width];
+            size_t write_idx = 0;
+            size_t best_idx = 0;
+            float best_score = 0.0f;
+            for (size_t read_idx = 0; read_idx < new_elem_count && write_idx < max_beam_width;
+                 read_idx++) {
+                const size_t r = read_idx * L + l;
+                const float score = cur_score[r];
+                if (!(score >= cutoff)) {
+                    continue;
+                }
+                if (write_idx == 0 || score > best_score) {
+                    best_idx = write_idx;
+                    best_score = score;
+                }
+                const size_t w = write_idx * L + l;
+                prev_hash[w] = cur_hash[r];
+                prev_score[w] = score - lane_back_scores[cur_state[r]];
+                prev_state[w] = cur_state[r];
+                beam[write_idx++] = {cur_state[r], cur_prev_index[r], cur_stay[r] != 0};
+            }
+            beam_width[l] = write_idx;
+
+            // At the last timestep only the best path is needed: like the merge sort with a
+            // cutoff of 1 in beam_search, put the first element with the highest score first
+            if (last_block) {
+                beam[0] = beam[best_idx];
+            }
+        }
+        common_width = *std::max_element(beam_width, beam_width + L);
+        pad_front(common_width);
+    }
+
+    // Write out the state path and move table of each lane
+    for (size_t l = 0; l < num_lanes; l++) {
+        states[l].resize(num_blocks);
+        moves[l].resize(num_blocks);
+        const BeamElement* const beam = &beam_vector[l * lane_beam_size];
+        uint8_t element_index = 0;
+        for (size_t beam_idx = num_blocks; beam_idx != 0; beam_idx--) {
+            const BeamElement& element = beam[beam_idx * max_beam_width + element_index];
+            states[l][beam_idx - 1] = int32_t(element.state);
+            moves[l][beam_idx - 1] = element.stay ? 0 : 1;
+            element_index = element.prev_element_index;
+        }
+        moves[l][0] = 1;  // Always step in the first event
+    }
+}
+
+// beam_search_lanes for a fixed number of states, with the common beam widths fixed too
+template <typename T, size_t kNumStates, typename... Args>
+static void beam_search_lanes_fixed_states(size_t beam_width, Args&&... args) {
+    switch (beam_width) {
+    case 32:
+        return beam_search_lanes<T, kNumStates, 32>(std::forward<Args>(args)...);
+    case 64:
+        return beam_search_lanes<T, kNumStates, 64>(std::forward<Args>(args)...);
+    default:
+        return beam_search_lanes<T, kNumStates, 0>(std::forward<Args>(args)...);
+    }
+}
+
+// beam_search_lanes specialised for the common model sizes (state_len 3, 4 and 5) and beam widths,
+// with the generic version for the others. The arguments are those of beam_search_lanes.
+template <typename T, typename... Args>
+static void beam_search_lanes_specialised(size_t num_states, size_t beam_width, Args&&... args) {
+    switch (num_states) {
+    case 64:
+        return beam_search_lanes_fixed_states<T, 64>(beam_width, std::forward<Args>(args)...);
+    case 256:
+        return beam_search_lanes_fixed_states<T, 256>(beam_width, std::forward<Args>(args)...);
+    case 1024:
+        return beam_search_lanes_fixed_states<T, 1024>(beam_width, std::forward<Args>(args)...);
+    default:
+        return beam_search_lanes<T>(std::forward<Args>(args)...);
+    }
+}
+
+std::vector<std::tuple<std::string, std::string, std::vector<uint8_t>>> beam_search_decode_lanes(
+        const std::vector<torch::Tensor>& scores_t,
+        const std::vector<torch::Tensor>& back_guides_t,
+        const std::vector<torch::Tensor>& posts_t,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature,
+        float byte_score_scale) {
+    const size_t num_lanes = scores_t.size();
+    if (num_lanes == 0 || num_lanes > beam_search_max_lanes || back_guides_t.size() != num_lanes ||
+        posts_t.size() != num_lanes) {
+        throw std::runtime_error("beam_search_decode_lanes: mismatched number of chunks");
+    }
+    const int num_blocks = int(scores_t[0].size(0));
+    const int num_states = get_num_states(scores_t[0].size(1));
+    const auto dtype = scores_t[0].dtype();
+
+    // The same checks as beam_search_decode, and all chunks must have the same shape and layout
+    std::vector<torch::Tensor> scores_contig(num_lanes);
+    std::vector<torch::Tensor> back_guides_contig(num_lanes);
+    std::vector<torch::Tensor> posts_contig(num_lanes);
+    for (size_t l = 0; l < num_lanes; l++) {
+        if (posts_t[l].dtype() != torch::kFloat32 || back_guides_t[l].dtype() != torch::kFloat32) {
+            throw std::runtime_error(
+                    "beam_search_decode_lanes: mismatched tensor types provided for posts and "
+                    "guides");
+        }
+        scores_contig[l] = (scores_t[l].stride(1) == 1) ? scores_t[l] : scores_t[l].contiguous();
+        back_guides_contig[l] = back_guides_t[l].contiguous();
+        posts_contig[l] = posts_t[l].contiguous();
+        if (scores_contig[l].sizes() != scores_contig[0].sizes() ||
+            scores_contig[l].stride(0) != scores_contig[0].stride(0) ||
+            scores_contig[l].dtype() != dtype) {
+            throw std::runtime_error("beam_search_decode_lanes: chunks of different shapes");
+        }
+    }
+    const size_t scores_block_stride = scores_contig[0].stride(0);
+
+    const float* back_guides[beam_search_max_lanes];
+    for (size_t l = 0; l < num_lanes; l++) {
+        back_guides[l] = back_guides_contig[l].data_ptr<float>();
+    }
+
+    DecoderWorkspace& workspace = decoder_workspace();
+    std::vector<uint8_t> moves[beam_search_max_lanes];
+    if (dtype == torch::kFloat32) {
+        const float* scores[beam_search_max_lanes];
+        for (size_t l = 0; l < num_lanes; l++) {
+            scores[l] = scores_contig[l].data_ptr<float>();
+        }
+        beam_search_lanes_specialised<float>(num_states, beam_width, scores, scores_block_stride,
+                                             back_guides, num_lanes, num_states, num_blocks,
+                                             beam_width, beam_cut, fixed_stay_score,
+                                             workspace.lane_states, moves, temperature, 1.0f,
+                                             workspace);
+    } else if (dtype == torch::kInt8) {
+        const int8_t* scores[beam_search_max_lanes];
+        for (size_t l = 0; l < num_lanes; l++) {
+            scores[l] = scores_contig[l].data_ptr<int8_t>();
+        }
+        beam_search_lanes_specialised<int8_t>(num_states, beam_width, scores, scores_block_stride,
+                                              back_guides, num_lanes, num_states, num_blocks,
+                                              beam_width, beam_cut, fixed_stay_score,
+                                              workspace.lane_states, moves, temperature,
+                                              byte_score_scale, workspace);
+    } else {
+        throw std::runtime_error(std::string("beam_search_decode_lanes: unsupported tensor type ") +
+                                 std::string(dtype.name()));
+    }
+
+    std::vector<std::tuple<std::string, std::string, std::vector<uint8_t>>> results(num_lanes);
+    std::vector<float>& qual_data = workspace.qual_data;
+    qual_data.resize(num_blocks * num_bases);
+    for (size_t l = 0; l < num_lanes; l++) {
+        std::vector<int32_t>& states = workspace.lane_states[l];
+        compute_qual_data(states, posts_contig[l].data_ptr<float>(), num_states, num_blocks,
+                          qual_data);
+        std::string sequence, qstring;
+        generate_sequence(moves[l], states, qual_data, q_shift, q_scale, workspace, sequence,
+                          qstring);
+        results[l] = std::make_tuple(std::move(sequence), std::move(qstring), std::move(moves[l]));
+    }
+    return results;
+}
+
+std::tuple<std::string, std::string, std::vector<uint8_t>> viterbi_decode(
+        const torch::Tensor& scores_t,
+        const torch::Tensor& path_scores_t,
+        const torch::Tensor& posts_t,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale) {
+    const int num_blocks = int(scores_t.size(0));
+    const int num_states = int(path_scores_t.size(1));
+
+    if (scores_t.dtype() != torch::kFloat32 || path_scores_t.dtype() != torch::kFloat32 ||
+        posts_t.dtype() != torch::kFloat32) {
+        throw std::runtime_error("viterbi_decode: scores, path scores and posts must be floats");
+    }
+    if (scores_t.size(1) != num_states * num_bases) {
+        throw std::runtime_error("viterbi_decode: only models with fixed stay scores are supported");
+    }
+
+    auto scores_block_contig = (scores_t.stride(1) == 1) ? scores_t : scores_t.contiguous();
+    auto path_scores_contig = path_scores_t.expect_contiguous();
+    auto posts_contig = posts_t.expect_contiguous();
+    const size_t scores_block_stride = scores_block_contig.stride(0);
+    const float* const scores = scores_block_contig.data_ptr<float>();
+    const float* const path_scores = path_scores_contig->data_ptr<float>();
+    const float* const posts = posts_contig->data_ptr<float>();
+
+    DecoderWorkspace& workspace = decoder_workspace();
+    std::vector<int32_t>& states = workspace.states;
+    std::vector<uint8_t> moves(num_blocks);
+    std::vector<float>& qual_data = workspace.qual_data;
+    states.resize(num_blocks);
+    qual_data.resize(num_blocks * num_bases);
+
+    // The best path ends in the best scoring state after the last block
+    const float* const last_scores = path_scores + size_t(num_blocks) * num_states;
+    int state = int(std::max_element(last_scores, last_scores + num_states) - last_scores);
+
+    // Trace the path back. Rather than keeping back pointers, the transition into each state of the
+    // path is found again from the path scores of the previous block (the same float sums the scan
+    // took the maximum of).
+    const int msb = num_states / num_bases;
+    for (int block_idx = num_blocks - 1; block_idx >= 0; block_idx--) {
+        const float* const prev_scores = path_scores + size_t(block_idx) * num_states;
+        const float* const block_scores = scores + block_idx * scores_block_stride;
+
+        states[block_idx] = state;
+
+        // Homopolymer states can also step into themselves, so the stay is tracked separately
+        float best_score = prev_scores[state] + fixed_stay_score;
+        int prev_state = state;
+        bool stay = true;
+        for (int shift_base = 0; shift_base < num_bases; shift_base++) {
+            int step_from = state / num_bases + msb * shift_base;
+            float step_score = prev_scores[step_from] + block_scores[state * num_bases + shift_base];
+            if (step_score > best_score) {
+                best_score = step_score;
+                prev_state = step_from;
+                stay = false;
+            }
+        }
+
+        moves[block_idx] = stay ? 0 : 1;
+        state = prev_state;
+    }
+    moves[0] = 1;  // Always step in the first event
+
+    compute_qual_data(states, posts, num_states, num_blocks, qual_data);
+
+    std::string sequence, qstring;
+    generate_sequence(moves, states, qual_data, q_shift, q_scale, workspace, sequence, qstring);
 
-    return std::make_tuple(sequence, qstring, moves);
+    return std::make_tuple(std::move(sequence), std::move(qstring), std::move(moves));
 }
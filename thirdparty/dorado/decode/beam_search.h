@@ -57,6 +57,82 @@ void merge_sort(T* data,
     }
 }
 
+// 16 bit state supports 7-mers with 4 bases.
+typedef int16_t state_t;
+
+// This is the data we need to retain for the whole beam
+struct BeamElement {
+    state_t state;
+    uint8_t prev_element_index;
+    bool stay;
+};
+
+// This is the data we need to retain for only the previous timestep (block) in the beam
+//  (and what we construct for the new timestep)
+struct BeamFrontElement {
+    uint64_t hash;
+    float score;
+    state_t state;
+    uint8_t prev_element_index;
+    bool stay;
+};
+
+// Number of chunks beam_search_decode_lanes advances together.
+constexpr size_t beam_search_max_lanes = 8;
+// Widest beam at which beam_search_decode_lanes is faster than beam_search_decode on each chunk.
+constexpr size_t beam_search_lanes_max_width = 64;
+
+// Beam fronts of beam_search_decode_lanes, as one array per field with the lanes of each element
+// next to each other: field[element * beam_search_max_lanes + lane].
+struct LaneBeamFront {
+    std::vector<uint64_t> hash;
+    std::vector<float> score;
+    std::vector<state_t> state;
+    std::vector<uint8_t> prev_element_index;
+    std::vector<uint8_t> stay;
+
+    void resize(size_t num_elements) {
+        hash.resize(num_elements * beam_search_max_lanes);
+        score.resize(num_elements * beam_search_max_lanes);
+        state.resize(num_elements * beam_search_max_lanes);
+        prev_element_index.resize(num_elements * beam_search_max_lanes);
+        stay.resize(num_elements * beam_search_max_lanes);
+    }
+};
+
+// Buffers for decoding chunks. Each decoding thread has its own (decoder_workspace()), which it
+// reuses for all the chunks it decodes, so decoding stops allocating once the buffers have grown
+// to the largest chunk.
+struct DecoderWorkspace {
+    // guides, posteriors and dequantised scores of the CPU decoder, as flat {capacity} tensors
+    torch::Tensor bwd;
+    torch::Tensor posts;
+    torch::Tensor float_scores;
+
+    std::vector<BeamElement> beam_vector;
+    std::vector<BeamFrontElement> beam_front_1;
+    std::vector<BeamFrontElement> beam_front_2;
+    std::vector<int16_t> step_table;
+    std::vector<float> sorted_back_guides;
+    std::vector<int32_t> states;
+    std::vector<float> qual_data;
+
+    // qstring characters by error probability for qstring_table_shift and qstring_table_scale
+    // (see generate_sequence)
+    std::vector<char> qstring_table;
+    float qstring_table_shift = 0.0f;
+    float qstring_table_scale = 0.0f;
+
+    // beams of beam_search_decode_lanes, one after the other
+    std::vector<BeamElement> lane_beam_vector;
+    LaneBeamFront lane_front_1;
+    LaneBeamFront lane_front_2;
+    std::vector<int32_t> lane_states[beam_search_max_lanes];
+};
+
+// The workspace of the calling thread.
+DecoderWorkspace& decoder_workspace();
+
 std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
         const torch::Tensor& scores_t,
         const torch::Tensor& back_guides_t,
@@ -67,4 +143,28 @@ std::tuple<std::string, std::string, std::vector<uint8_t>> beam_search_decode(
         float q_shift,
         float q_scale,
         float temperature,
-        float byte_score_scale);
\ No newline at end of file
+        float byte_score_scale);
+// beam_search_decode of up to beam_search_max_lanes chunks of the same length at once. The chunks
+// go through the blocks together, with the beam fronts of all the chunks side by side, so the
+// maximum scores and the counts against the beam cutoffs vectorise across chunks. The results are
+// the same as those of beam_search_decode on each chunk.
+std::vector<std::tuple<std::string, std::string, std::vector<uint8_t>>> beam_search_decode_lanes(
+        const std::vector<torch::Tensor>& scores_t,
+        const std::vector<torch::Tensor>& back_guides_t,
+        const std::vector<torch::Tensor>& posts_t,
+        size_t beam_width,
+        float beam_cut,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale,
+        float temperature,
+        float byte_score_scale);
+// Single best path (max-product) decode. path_scores are the {T + 1, num_states} scores from
+// crf_viterbi_scan and posts the state probabilities used for the qstring.
+std::tuple<std::string, std::string, std::vector<uint8_t>> viterbi_decode(
+        const torch::Tensor& scores_t,
+        const torch::Tensor& path_scores_t,
+        const torch::Tensor& posts_t,
+        float fixed_stay_score,
+        float q_shift,
+        float q_scale);
@@ -0,0 +1,100 @@
+#include "crf_scan.h"
+
+#include "crf_scan_impl.h"
+
+namespace {
+
+// VecBase with the block loads of the scans, one block of four states per register.
+struct VecScan : VecBase {
+#if defined(__x86_64__) || defined(__SSE2__)
+    static type bcast_blocks(const float* p, int64_t) { return _mm_set1_ps(p[0]); }
+    static type load_blocks(const float* p, int64_t) { return _mm_loadu_ps(p); }
+    static void load_transposed_blocks(const float* p, type* out) {
+        out[0] = _mm_loadu_ps(p);
+        out[1] = _mm_loadu_ps(p + 4);
+        out[2] = _mm_loadu_ps(p + 8);
+        out[3] = _mm_loadu_ps(p + 12);
+        _MM_TRANSPOSE4_PS(out[0], out[1], out[2], out[3]);
+    }
+#elif defined(__aarch64__)
+    static type bcast_blocks(const float* p, int64_t) { return vdupq_n_f32(p[0]); }
+    static type load_blocks(const float* p, int64_t) { return vld1q_f32(p); }
+    static void load_transposed_blocks(const float* p, type* out) {
+        float32x4x4_t m = vld4q_f32(p);
+        out[0] = m.val[0];
+        out[1] = m.val[1];
+        out[2] = m.val[2];
+        out[3] = m.val[3];
+    }
+#else
+    static type bcast_blocks(const float* p, int64_t) { return set1(p[0]); }
+    static type load_blocks(const float* p, int64_t) { return load(p); }
+    static void load_transposed_blocks(const float* p, type* out) {
+        for (int k = 0; k < 4; k++) {
+            out[k] = {{p[k], p[4 + k], p[8 + k], p[12 + k]}};
+        }
+    }
+#endif
+};
+
+const CrfScanKernels base_kernels = {forward_scan<VecScan, false>, backward_scan<VecScan>,
+                                     posteriors<VecScan>, forward_scan<VecScan, true>};
+
+const CrfScanKernels* select_kernels() {
+#if defined(__x86_64__)
+    const CrfScanKernels* avx2 = crf_scan_avx2_kernels();
+    if (avx2 != nullptr && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return avx2;
+    }
+#endif
+    return &base_kernels;
+}
+
+const CrfScanKernels* best_kernels() {
+    static const CrfScanKernels* best = select_kernels();
+    return best;
+}
+
+// The AVX2 kernels process two blocks at a time.
+const CrfScanKernels* get_kernels(int num_states) {
+    return (num_states % 8 == 0) ? best_kernels() : &base_kernels;
+}
+
+}  // namespace
+
+void crf_forward_scan(const float* scores,
+                      int64_t score_stride,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float* alpha,
+                      int64_t out_stride) {
+    get_kernels(num_states)->forward(scores, score_stride, T, num_states, fixed_stay_score, alpha,
+                                     out_stride);
+}
+
+void crf_backward_scan(const float* scores,
+                       int64_t score_stride,
+                       int T,
+                       int num_states,
+                       float fixed_stay_score,
+                       float* beta,
+                       int64_t out_stride) {
+    get_kernels(num_states)->backward(scores, score_stride, T, num_states, fixed_stay_score, beta,
+                                      out_stride);
+}
+
+void crf_posteriors(float* posts, const float* beta, int T, int num_states) {
+    get_kernels(num_states)->posteriors(posts, beta, T, num_states);
+}
+
+void crf_viterbi_scan(const float* scores,
+                      int64_t score_stride,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float* path_scores,
+                      int64_t out_stride) {
+    get_kernels(num_states)->viterbi(scores, score_stride, T, num_states, fixed_stay_score,
+                                     path_scores, out_stride);
+}
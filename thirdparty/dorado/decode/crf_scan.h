@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+// Log-space forward and backward scans over the CRF transition scores of a single chunk.
+//
+// scores holds T rows of num_states * 4 transition scores, score_stride floats apart, where the score
+// for stepping into state s from predecessor (s >> 2) + k * (num_states / 4) is at s * 4 + k.
+// T + 1 rows of num_states guide values are written to out, out_stride floats apart: alpha[0] (and
+// beta[T]) are zero, like the guide values of the torch scan.
+void crf_forward_scan(const float* scores,
+                      int64_t score_stride,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float* alpha,
+                      int64_t out_stride);
+
+void crf_backward_scan(const float* scores,
+                       int64_t score_stride,
+                       int T,
+                       int num_states,
+                       float fixed_stay_score,
+                       float* beta,
+                       int64_t out_stride);
+
+// Posterior state probabilities softmax(alpha + beta) of each of the T + 1 rows, computed in place
+// over the forward guide values in posts. Both buffers are contiguous {T + 1, num_states}.
+// With a null beta, this is the softmax of the rows of posts alone.
+void crf_posteriors(float* posts, const float* beta, int T, int num_states);
+
+// Max-product version of crf_forward_scan: path_scores[t][s] is the score of the best path ending in
+// state s after t transitions.
+void crf_viterbi_scan(const float* scores,
+                      int64_t score_stride,
+                      int T,
+                      int num_states,
+                      float fixed_stay_score,
+                      float* path_scores,
+                      int64_t out_stride);
@@ -0,0 +1,50 @@
+// AVX2 versions of the CRF scans. This file is built with -mavx2 -mfma on x86-64 and the kernels are
+// only used after checking the CPU at runtime, so nothing here may be shared with the other
+// translation units (hence the anonymous namespace in crf_scan_impl.h).
+
+#include "crf_scan_impl.h"
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+namespace {
+
+// Two blocks of four states per AVX2 register, one in each 128-bit lane.
+struct VecScanAVX2 : VecAVX2 {
+    static type pair(__m128 lo, __m128 hi) {
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+    static type bcast_blocks(const float* p, int64_t stride) {
+        return pair(_mm_set1_ps(p[0]), _mm_set1_ps(p[stride]));
+    }
+    static type load_blocks(const float* p, int64_t stride) {
+        return pair(_mm_loadu_ps(p), _mm_loadu_ps(p + stride));
+    }
+    static void load_transposed_blocks(const float* p, type* out) {
+        type r0 = load_blocks(p, 16);
+        type r1 = load_blocks(p + 4, 16);
+        type r2 = load_blocks(p + 8, 16);
+        type r3 = load_blocks(p + 12, 16);
+        // 4x4 transpose within each 128-bit lane
+        type t0 = _mm256_unpacklo_ps(r0, r1);
+        type t1 = _mm256_unpacklo_ps(r2, r3);
+        type t2 = _mm256_unpackhi_ps(r0, r1);
+        type t3 = _mm256_unpackhi_ps(r2, r3);
+        out[0] = _mm256_shuffle_ps(t0, t1, 0x44);
+        out[1] = _mm256_shuffle_ps(t0, t1, 0xee);
+        out[2] = _mm256_shuffle_ps(t2, t3, 0x44);
+        out[3] = _mm256_shuffle_ps(t2, t3, 0xee);
+    }
+};
+
+const CrfScanKernels avx2_kernels = {forward_scan<VecScanAVX2, false>, backward_scan<VecScanAVX2>,
+                                     posteriors<VecScanAVX2>, forward_scan<VecScanAVX2, true>};
+
+}  // namespace
+
+const CrfScanKernels* crf_scan_avx2_kernels() { return &avx2_kernels; }
+
+#else
+
+const CrfScanKernels* crf_scan_avx2_kernels() { return nullptr; }
+
+#endif
@@ -0,0 +1,195 @@
+#pragma once
+
+// Vector-width independent parts of the CRF scans, shared by crf_scan.cpp and crf_scan_avx2.cpp.
+//
+// The states are processed in blocks of four. For block q of the forward scan, the four states
+// 4q..4q+3 share the four predecessors q + k * num_states / 4 and use the 16 contiguous scores at
+// 16q. For block r of the backward scan, the four states r + k * num_states / 4 share the four
+// successors 4r..4r+3 and use the 16 scores at 16r. A vector type V holds V::W / 4 such blocks,
+// with the four states of a block in adjacent lanes, so the log-sum-exp is purely elementwise.
+//
+// V is a vector type of utils/simd_math.h extended with the block loads used below. Everything
+// lives in an anonymous namespace, so the copies built with different instruction sets in
+// different translation units never collide.
+
+#include "../utils/simd_math.h"
+
+#include <cstdint>
+
+struct CrfScanKernels {
+    void (*forward)(const float*, int64_t, int, int, float, float*, int64_t);
+    void (*backward)(const float*, int64_t, int, int, float, float*, int64_t);
+    void (*posteriors)(float*, const float*, int, int);
+    void (*viterbi)(const float*, int64_t, int, int, float, float*, int64_t);
+};
+
+// The AVX2 kernels, or nullptr if crf_scan_avx2.cpp was not built for AVX2.
+const CrfScanKernels* crf_scan_avx2_kernels();
+
+namespace {
+
+// log(exp(x0) + ... + exp(x4)), the same reduction as torch::logsumexp
+template <class V>
+inline typename V::type logsumexp5(typename V::type x0,
+                                   typename V::type x1,
+                                   typename V::type x2,
+                                   typename V::type x3,
+                                   typename V::type x4) {
+    typedef typename V::type type;
+    type mx = V::max(V::max(V::max(x0, x1), V::max(x2, x3)), x4);
+    type sum = V::exp(V::sub(x0, mx));
+    sum = V::add(sum, V::exp(V::sub(x1, mx)));
+    sum = V::add(sum, V::exp(V::sub(x2, mx)));
+    sum = V::add(sum, V::exp(V::sub(x3, mx)));
+    sum = V::add(sum, V::exp(V::sub(x4, mx)));
+    return V::add(mx, V::log(sum));
+}
+
+// max(x0, ..., x4), the max-product counterpart of logsumexp5
+template <class V>
+inline typename V::type max5(typename V::type x0,
+                             typename V::type x1,
+                             typename V::type x2,
+                             typename V::type x3,
+                             typename V::type x4) {
+    return V::max(V::max(V::max(x0, x1), V::max(x2, x3)), x4);
+}
+
+// kViterbi selects the max-product scan (best path scores) instead of the sum-product one
+template <class V, bool kViterbi>
+void forward_scan(const float* scores,
+                  int64_t score_stride,
+                  int T,
+                  int num_states,
+                  float fixed_stay_score,
+                  float* alpha,
+                  int64_t out_stride) {
+    typedef typename V::type type;
+    const int num_blocks = num_states / 4;
+    const int step = V::W / 4;
+    const type stay = V::set1(fixed_stay_score);
+
+    for (int s = 0; s < num_states; s++) {
+        alpha[s] = 0.0f;
+    }
+
+    for (int t = 0; t < T; t++) {
+        const float* prev = alpha + t * out_stride;
+        float* next = alpha + (t + 1) * out_stride;
+        const float* ms = scores + t * score_stride;
+
+        for (int q = 0; q < num_blocks; q += step) {
+            type m[4];
+            V::load_transposed_blocks(ms + 16 * q, m);
+
+            type x_stay = V::add(V::load(prev + 4 * q), stay);
+            type x0 = V::add(V::bcast_blocks(prev + q, 1), m[0]);
+            type x1 = V::add(V::bcast_blocks(prev + q + num_blocks, 1), m[1]);
+            type x2 = V::add(V::bcast_blocks(prev + q + 2 * num_blocks, 1), m[2]);
+            type x3 = V::add(V::bcast_blocks(prev + q + 3 * num_blocks, 1), m[3]);
+
+            V::store(next + 4 * q, kViterbi ? max5<V>(x_stay, x0, x1, x2, x3)
+                                            : logsumexp5<V>(x_stay, x0, x1, x2, x3));
+        }
+    }
+}
+
+template <class V>
+void backward_scan(const float* scores,
+                   int64_t score_stride,
+                   int T,
+                   int num_states,
+                   float fixed_stay_score,
+                   float* beta,
+                   int64_t out_stride) {
+    typedef typename V::type type;
+    const int num_blocks = num_states / 4;
+    const int step = V::W / 4;
+    const type stay = V::set1(fixed_stay_score);
+    float lanes[V::W];
+
+    float* last = beta + T * out_stride;
+    for (int s = 0; s < num_states; s++) {
+        last[s] = 0.0f;
+    }
+
+    for (int t = T - 1; t >= 0; t--) {
+        const float* next = beta + (t + 1) * out_stride;
+        float* cur = beta + t * out_stride;
+        const float* ms = scores + t * score_stride;
+
+        for (int r = 0; r < num_blocks; r += step) {
+            // the states of block r are num_blocks apart
+            for (int j = 0; j < step; j++) {
+                for (int k = 0; k < 4; k++) {
+                    lanes[4 * j + k] = next[r + j + k * num_blocks];
+                }
+            }
+            type x_stay = V::add(V::load(lanes), stay);
+
+            type x0 = V::add(V::bcast_blocks(next + 4 * r, 4), V::load_blocks(ms + 16 * r, 16));
+            type x1 = V::add(V::bcast_blocks(next + 4 * r + 1, 4),
+                             V::load_blocks(ms + 16 * r + 4, 16));
+            type x2 = V::add(V::bcast_blocks(next + 4 * r + 2, 4),
+                             V::load_blocks(ms + 16 * r + 8, 16));
+            type x3 = V::add(V::bcast_blocks(next + 4 * r + 3, 4),
+                             V::load_blocks(ms + 16 * r + 12, 16));
+
+            V::store(lanes, logsumexp5<V>(x_stay, x0, x1, x2, x3));
+            for (int j = 0; j < step; j++) {
+                for (int k = 0; k < 4; k++) {
+                    cur[r + j + k * num_blocks] = lanes[4 * j + k];
+                }
+            }
+        }
+    }
+}
+
+template <class V>
+void posteriors(float* posts, const float* beta, int T, int num_states) {
+    typedef typename V::type type;
+    float lanes[V::W];
+
+    for (int t = 0; t <= T; t++) {
+        float* row = posts + t * num_states;
+        const float* beta_row = (beta != nullptr) ? beta + t * num_states : nullptr;
+
+        type mx = V::set1(-1e38f);
+        if (beta != nullptr) {
+            for (int s = 0; s < num_states; s += V::W) {
+                type x = V::add(V::load(row + s), V::load(beta_row + s));
+                V::store(row + s, x);
+                mx = V::max(mx, x);
+            }
+        } else {
+            for (int s = 0; s < num_states; s += V::W) {
+                mx = V::max(mx, V::load(row + s));
+            }
+        }
+        V::store(lanes, mx);
+        float row_max = lanes[0];
+        for (int i = 1; i < V::W; i++) {
+            row_max = lanes[i] > row_max ? lanes[i] : row_max;
+        }
+
+        mx = V::set1(row_max);
+        type sum = V::set1(0.0f);
+        for (int s = 0; s < num_states; s += V::W) {
+            type e = V::exp(V::sub(V::load(row + s), mx));
+            V::store(row + s, e);
+            sum = V::add(sum, e);
+        }
+        V::store(lanes, sum);
+        float row_sum = 0.0f;
+        for (int i = 0; i < V::W; i++) {
+            row_sum += lanes[i];
+        }
+
+        type total = V::set1(row_sum);
+        for (int s = 0; s < num_states; s += V::W) {
+            V::store(row + s, V::div(V::load(row + s), total));
+        }
+    }
+}
+
+}  // namespace
@@ -76,29 +76,3 @@ uint32_t fasthash32(const void *buf, size_t len, uint32_t seed) {
     uint64_t h = fasthash64(buf, len, seed);
     return uint32_t(h - (h >> 32));
 }
-
-
-/**  Chain a new value to hash
- *
- *   `fasthash64` specialised to case of calculating the new hash
- *   from the previous data when a new value is appended.
- *
- *   Note:
- *       It is assumed that the value added is always 64bits wide,
- *   unlike `fasthash64` which combines blocks of bytes into 64bits
- *   values.
- *
- *   Args:
- *       hash (uint64_t): Hash of previous data
- *       val  (uint64_t): Value to chain to hash
- *
- *   Returns:
- *       uint64_t: New hash with value added
- **/
-uint64_t chainfasthash64(uint64_t hash, uint64_t val) {
-    const uint64_t m = 0x880355f21e6d1965ULL;
-
-    hash ^= mix(val);
-    hash *= m;
-    return mix(hash);
-}
\ No newline at end of file
@@ -48,5 +48,21 @@ uint64_t fasthash64(const void *buf, size_t len, uint64_t seed);
  * chainfasthash64 - chain values to hash
  * @hash: Hash of previous data
  * @val:  New value to chain to hash
+ *
+ * `fasthash64` specialised to the case of calculating the new hash from the
+ * previous data when a new 64-bit value is appended. Inline, as the beam
+ * search chains a hash for every candidate.
  */
-uint64_t chainfasthash64(uint64_t hash, uint64_t val);
\ No newline at end of file
+inline uint64_t chainfasthash64(uint64_t hash, uint64_t val) {
+    const uint64_t m = 0x880355f21e6d1965ULL;
+
+    val ^= val >> 23;
+    val *= 0x2127599bf4325c37ULL;
+    val ^= val >> 47;
+    hash ^= val;
+    hash *= m;
+    hash ^= hash >> 23;
+    hash *= 0x2127599bf4325c37ULL;
+    hash ^= hash >> 47;
+    return hash;
+}
\ No newline at end of file
@@ -4,8 +4,16 @@
 
 #include "toml.h"
 #include "CRFModel.h"
+#include "PackedModel.h"
 #include "error.h"
 #include "../utils/tensor_utils.h"
+#include "LSTMCell.h"
+
+#include <ATen/Parallel.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 #ifdef USE_CUDA_LSTM
 #include "../utils/cuda_utils.h"
@@ -39,8 +47,15 @@ ModuleHolder<AnyModule> populate_model(Model &&model,
                                        const torch::TensorOptions &options,
                                        bool decomposition,
                                        bool bias) {
-    auto state_dict = load_crf_model_weights(path, decomposition, bias);
-    model->load_state_dict(state_dict);
+    if (is_packed_model(path) && options.device() == torch::kCPU) {
+        // The parameters become views of the mapped file, with no copy
+        module_share_state_dict(*model, load_packed_model_weights(path));
+    } else {
+        auto state_dict = is_packed_model(path)
+                                  ? load_packed_model_weights(path)
+                                  : load_crf_model_weights(path, decomposition, bias);
+        model->load_state_dict(state_dict);
+    }
     model->to(options.dtype_opt().value().toScalarType());
     model->to(options.device_opt().value());
     model->eval();
@@ -134,6 +149,49 @@ struct ConvolutionImpl : Module {
     const bool to_lstm;
 };
 
+// Linear layer with int8 weights for the CPU, built from the weights of a float layer. The
+// activations are quantised on the fly by fbgemm, with a range taken from each input. The weights
+// get a scale per output channel: each row is normalised to [-1, 1] before fbgemm quantises the
+// whole matrix, and the outputs are scaled back per channel together with the bias.
+// The at::fbgemm_linear_* ops are deprecated in libtorch (they warn once when first used) but are
+// still there in libtorch 1.12 (scripts/install-torch12.sh), which this is written against. A
+// libtorch that drops them needs this layer moved to the quantized::linear_dynamic ops.
+struct Int8LinearImpl : Module {
+    Int8LinearImpl(const torch::Tensor &weight, const torch::Tensor &bias_) {
+        auto w = weight.to(torch::kFloat32).contiguous();
+        channel_scale = w.abs().amax(1).clamp_min(1e-12f);
+        bias = bias_.defined() ? bias_.to(torch::kFloat32).contiguous() : bias_;
+        zero_bias = torch::zeros({w.size(0)});
+
+        auto quantized = at::fbgemm_linear_quantize_weight(w / channel_scale.unsqueeze(1));
+        q_weight = std::get<0>(quantized);
+        col_offsets = std::get<1>(quantized);
+        weight_scale = std::get<2>(quantized);
+        weight_zero_point = std::get<3>(quantized);
+        packed_weight = at::fbgemm_pack_quantized_matrix(q_weight);
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        // Input x is [..., C_in], contiguity optional
+        auto sizes = x.sizes().vec();
+        sizes.back() = q_weight.size(0);
+
+        auto y = at::fbgemm_linear_int8_weight_fp32_activation(
+                x.reshape({-1, x.size(-1)}).contiguous(), q_weight, packed_weight, col_offsets,
+                weight_scale, weight_zero_point, zero_bias);
+        y = bias.defined() ? torch::addcmul(bias, y, channel_scale) : y.mul_(channel_scale);
+
+        // Output is [..., C_out], contiguous
+        return y.view(sizes);
+    }
+
+    torch::Tensor q_weight, packed_weight, col_offsets, channel_scale, bias, zero_bias;
+    double weight_scale;
+    int64_t weight_zero_point;
+};
+
+TORCH_MODULE(Int8Linear);
+
 struct LinearCRFImpl : Module {
     LinearCRFImpl(int insize, int outsize) : scale(5), blank_score(2.0), expand_blanks(false) {
         linear = register_module("linear", Linear(insize, outsize));
@@ -160,7 +218,7 @@ struct LinearCRFImpl : Module {
         } else
 #endif  // if USE_CUDA_LSTM
         {
-            scores = activation(linear(x)) * scale;
+            scores = activation(qlinear ? qlinear(x) : linear(x)) * scale;
         }
 
         if (expand_blanks == true) {
@@ -174,10 +232,13 @@ struct LinearCRFImpl : Module {
         return scores;
     }
 
+    void quantize() { qlinear = Int8Linear(linear->weight, linear->bias); }
+
     int scale;
     int blank_score;
     bool expand_blanks;
     Linear linear{nullptr};
+    Int8Linear qlinear{nullptr};  // int8 copy of linear, used instead once set
     Tanh activation{nullptr};
 };
 
@@ -522,6 +583,123 @@ struct LSTMStackImpl : Module {
     LSTM rnn1{nullptr}, rnn2{nullptr}, rnn3{nullptr}, rnn4{nullptr}, rnn5{nullptr};
 };
 
+// A single LSTM layer for the CPU. The parameters are registered in the torch::nn::LSTM order,
+// so the weights load the same way. A reverse layer walks the sequence backwards instead of
+// flipping its input and output.
+struct CpuLSTMImpl : Module {
+    CpuLSTMImpl(int layer_size_, bool reverse_) : layer_size(layer_size_), reverse(reverse_) {
+        weight_ih = register_parameter("weight_ih_l0", torch::empty({4 * layer_size, layer_size}),
+                                       false);
+        weight_hh = register_parameter("weight_hh_l0", torch::empty({4 * layer_size, layer_size}),
+                                       false);
+        bias_ih = register_parameter("bias_ih_l0", torch::empty({4 * layer_size}), false);
+        bias_hh = register_parameter("bias_hh_l0", torch::empty({4 * layer_size}), false);
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        // Input is [T, N, C], contiguous, float32 or bfloat16
+        const int T = x.size(0);
+        const int N = x.size(1);
+        const int H = layer_size;
+        // bf16 layers run their matmuls in bf16, but the gates and the cell state stay in fp32
+        const bool bf16 = x.scalar_type() == torch::kBFloat16;
+
+        // The input projection of every timestep as a single matmul: [T, N, 4H]
+        torch::Tensor gates;
+        if (q_ih) {
+            gates = q_ih(x);
+        } else {
+            gates = torch::addmm(bias_ih + bias_hh, x.view({T * N, H}), weight_ih.t())
+                            .view({T, N, 4 * H});
+        }
+        if (bf16) {
+            gates = gates.to(torch::kFloat32);
+        }
+        auto w_hh_t = weight_hh.t();
+        auto y = torch::empty({T, N, H}, x.options());
+        auto c = torch::zeros({N, H}, torch::kFloat32);
+        auto h_fp32 = bf16 ? torch::empty({N, H}, torch::kFloat32) : torch::Tensor();
+
+        for (int i = 0; i < T; i++) {
+            const int t = reverse ? T - 1 - i : i;
+            auto gates_t = gates[t];
+            if (i > 0) {
+                auto h = y[reverse ? t + 1 : t - 1];
+                if (q_hh) {
+                    gates_t.add_(q_hh(h));
+                } else if (bf16) {
+                    gates_t.add_(torch::mm(h, w_hh_t));
+                } else {
+                    gates_t.addmm_(h, w_hh_t);
+                }
+            }
+
+            const float *g = gates_t.data_ptr<float>();
+            float *c_ptr = c.data_ptr<float>();
+            float *h_ptr = bf16 ? h_fp32.data_ptr<float>() : y[t].data_ptr<float>();
+            at::parallel_for(0, N, 4, [&](int64_t begin, int64_t end) {
+                lstm_cell_forward(g + begin * 4 * H, c_ptr + begin * H, h_ptr + begin * H,
+                                  end - begin, H);
+            });
+            if (bf16) {
+                y[t].copy_(h_fp32);
+            }
+        }
+
+        // Output is [T, N, C], contiguous
+        return y;
+    }
+
+    void quantize() {
+        q_ih = Int8Linear(weight_ih, bias_ih + bias_hh);
+        q_hh = Int8Linear(weight_hh, torch::Tensor());
+    }
+
+    int layer_size;
+    bool reverse;
+    torch::Tensor weight_ih, weight_hh, bias_ih, bias_hh;
+    Int8Linear q_ih{nullptr}, q_hh{nullptr};  // int8 copies of the weights, used once set
+};
+
+TORCH_MODULE(CpuLSTM);
+
+struct CpuLSTMStackImpl : Module {
+    CpuLSTMStackImpl(int layer_size, int batch_size, int chunk_size) {
+        rnn1 = register_module("rnn1", CpuLSTM(layer_size, true));
+        rnn2 = register_module("rnn2", CpuLSTM(layer_size, false));
+        rnn3 = register_module("rnn3", CpuLSTM(layer_size, true));
+        rnn4 = register_module("rnn4", CpuLSTM(layer_size, false));
+        rnn5 = register_module("rnn5", CpuLSTM(layer_size, true));
+    }
+
+    torch::Tensor forward(torch::Tensor x) {
+        // Input is [N, T, C], contiguity optional
+        // The layers run time-major, so that each timestep is one contiguous [N, C] block
+        x = x.transpose(0, 1).contiguous();
+
+        x = rnn1(x);
+        x = rnn2(x);
+        x = rnn3(x);
+        x = rnn4(x);
+        x = rnn5(x);
+
+        // Output is [N, T, C], non-contiguous
+        return x.transpose(0, 1);
+    }
+
+    void quantize() {
+        rnn1->quantize();
+        rnn2->quantize();
+        rnn3->quantize();
+        rnn4->quantize();
+        rnn5->quantize();
+    }
+
+    CpuLSTM rnn1{nullptr}, rnn2{nullptr}, rnn3{nullptr}, rnn4{nullptr}, rnn5{nullptr};
+};
+
+TORCH_MODULE(CpuLSTMStack);
+
 struct ClampImpl : Module {
     ClampImpl(float _min, float _max, bool _active) : min(_min), max(_max), active(_active){};
 
@@ -564,15 +742,18 @@ struct CRFModelImpl : Module {
             clamp4 = Clamp(-5.0, 5.0, config.clamp);
             encoder = Sequential(conv1, clamp1, conv2, clamp2, conv3, clamp3, rnns, linear1,
                                  linear2, clamp4);
+            bounded_scores = config.clamp;
         } else if ((config.conv == 16) && (config.num_features == 1)) {
             linear1 = register_module(
                     "linear1", Linear(LinearOptions(config.insize, config.outsize).bias(false)));
             clamp4 = Clamp(-5.0, 5.0, config.clamp);
             encoder =
                     Sequential(conv1, clamp1, conv2, clamp2, conv3, clamp3, rnns, linear1, clamp4);
+            bounded_scores = config.clamp;
         } else {
             linear = register_module("linear1", LinearCRF(config.insize, config.outsize));
             encoder = Sequential(conv1, conv2, conv3, rnns, linear);
+            bounded_scores = true;
         }
     }
 
@@ -582,9 +763,45 @@ struct CRFModelImpl : Module {
 
     torch::Tensor forward(torch::Tensor x) {
         // Output is [N, T, C]
-        return encoder->forward(x);
+        auto scores = encoder->forward(x);
+        if (int8_scores) {
+            // int8 scores in steps of int8_score_scale
+            scores = scores.mul(1.0f / int8_score_scale).round_().clamp_(-127, 127);
+            return scores.to(torch::kInt8);
+        }
+        return scores;
+    }
+
+    // Switch the LSTM and linear layers to int8 weights, once the float weights are loaded.
+    // Only available with an LSTM stack that supports it. The scores are only quantised too when
+    // they are bounded to int8_score_scale's [-5, 5], and stay floats otherwise.
+    void quantize() {
+        rnns->quantize();
+        if (linear) {
+            linear->quantize();
+        } else {
+            Sequential layers;
+            for (const auto &layer : *encoder) {
+                if (layer.ptr() == linear1.ptr()) {
+                    layers->push_back(Int8Linear(linear1->weight, linear1->bias));
+                } else if (linear2 && layer.ptr() == linear2.ptr()) {
+                    layers->push_back(Int8Linear(linear2->weight, linear2->bias));
+                } else {
+                    layers->push_back(layer);
+                }
+            }
+            encoder = layers;
+        }
+        int8_scores = bounded_scores;
+        if (!bounded_scores) {
+            WARNING("%s", "scores of unclamped models are not quantised, only the weights");
+        }
     }
 
+    // Whether the scores lie within [-5, 5] (clamped, or 5 * tanh), and whether they come out as
+    // int8
+    bool bounded_scores = false;
+    bool int8_scores = false;
     LSTMStackType rnns{nullptr};
     LinearCRF linear{nullptr};
     Linear linear1{nullptr}, linear2{nullptr};
@@ -598,20 +815,60 @@ using CudaCRFModelImpl = CRFModelImpl<CudaLSTMStack>;
 TORCH_MODULE(CudaCRFModel);
 #endif
 
-using CpuCRFModelImpl = CRFModelImpl<LSTMStack>;
+using CpuCRFModelImpl = CRFModelImpl<CpuLSTMStack>;
 TORCH_MODULE(CpuCRFModel);
 
+// torch::nn::LSTM based model, for devices without a native LSTM implementation
+using TorchCRFModelImpl = CRFModelImpl<LSTMStack>;
+TORCH_MODULE(TorchCRFModel);
+
+bool cpu_has_bf16() {
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, nullptr) < 7) {
+        return false;
+    }
+
+    // The OS must save the AVX-512 state (XCR0 bits 1-2 and 5-7)
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_OSXSAVE)) {
+        return false;
+    }
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0xe6) != 0xe6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    // AMX-BF16 also needs the tile state (XCR0 bits 17-18)
+    const bool amx_bf16 = ((edx >> 22) & 1) && ((xcr0_lo & 0x60000) == 0x60000);
+    __cpuid_count(7, 1, eax, ebx, ecx, edx);
+    const bool avx512_bf16 = (eax >> 5) & 1;
+
+    return avx512_bf16 || amx_bf16;
+#else
+    return false;
+#endif
+}
+
 CRFModelConfig load_crf_model_config(const std::string &path) {
     FILE* fp;
     char errbuf[200];
+    toml_table_t *config_toml;
 
-    fp = fopen((path + "/config.toml").c_str(), "r");
-    if (!fp) {
-        ERROR("cannot open toml - %s", (path + "/config.toml").c_str());
-    }
+    if (is_packed_model(path)) {
+        std::string config_text = load_packed_model_config(path);
+        config_toml = toml_parse(&config_text[0], errbuf, sizeof(errbuf));
+    } else {
+        fp = fopen((path + "/config.toml").c_str(), "r");
+        if (!fp) {
+            ERROR("cannot open toml - %s", (path + "/config.toml").c_str());
+        }
 
-    toml_table_t *config_toml = toml_parse_file(fp, errbuf, sizeof(errbuf));
-    fclose(fp);
+        config_toml = toml_parse_file(fp, errbuf, sizeof(errbuf));
+        fclose(fp);
+    }
 
     if (!config_toml) {
         ERROR("cannot parse - %s", errbuf);
@@ -744,7 +1001,9 @@ ModuleHolder<AnyModule> load_crf_model(const std::string &path,
                                        const CRFModelConfig &model_config,
                                        const int batch_size,
                                        const int chunk_size,
-                                       const torch::TensorOptions &options) {
+                                       const torch::TensorOptions &options,
+                                       ModelPrecision precision) {
+    const auto dtype = options.dtype_opt().value().toScalarType();
 #if USE_CUDA_LSTM
     if (options.device() != torch::kCPU) {
         const bool expand_blanks = false;
@@ -753,9 +1012,23 @@ ModuleHolder<AnyModule> load_crf_model(const std::string &path,
                               model_config.bias);
     } else
 #endif
-    {
+    if (options.device() == torch::kCPU &&
+        (dtype == torch::kFloat32 || dtype == torch::kBFloat16)) {
         const bool expand_blanks = true;
         auto model = CpuCRFModel(model_config, expand_blanks, batch_size, chunk_size);
+        auto holder = populate_model(model, path, options, model_config.decomposition,
+                                     model_config.bias);
+        if (precision == ModelPrecision::INT8 && dtype == torch::kFloat32) {
+            if (at::fbgemm_is_cpu_supported()) {
+                model->quantize();
+            } else {
+                WARNING("%s", "int8 inference is not supported on this CPU, using fp32");
+            }
+        }
+        return holder;
+    } else {
+        const bool expand_blanks = true;
+        auto model = TorchCRFModel(model_config, expand_blanks, batch_size, chunk_size);
         return populate_model(model, path, options, model_config.decomposition,
                               model_config.bias);
     }
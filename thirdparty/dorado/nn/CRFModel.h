@@ -25,14 +25,28 @@ struct CRFModelConfig {
     int num_features;
 };
 
+// Precision of the model weights and matmuls, for CPU models only. With INT8 the LSTM and linear
+// layers run int8 GEMMs and the scores come out as int8, in steps of int8_score_scale, when the
+// model bounds them (float otherwise). BF16 runs the whole model in bfloat16 (the model is loaded
+// with a bfloat16 dtype).
+enum class ModelPrecision { FP32, INT8, BF16 };
+
+// Scores of CRF models with a clamp or a tanh head lie within [-5, 5]
+constexpr float int8_score_scale = 5.0f / 127.0f;
+
+// True if the CPU has native bf16 matmuls (AVX512-BF16 or AMX), which libtorch picks at runtime
+bool cpu_has_bf16();
+
 CRFModelConfig load_crf_model_config(const std::string& path);
 
 std::vector<torch::Tensor> load_crf_model_weights(const std::string& dir,
                                                   bool decomposition,
                                                   bool bias);
 
-torch::nn::ModuleHolder<torch::nn::AnyModule> load_crf_model(const std::string& path,
-                                                             const CRFModelConfig& model_config,
-                                                             int batch_size,
-                                                             int chunk_size,
-                                                             const torch::TensorOptions& options);
+torch::nn::ModuleHolder<torch::nn::AnyModule> load_crf_model(
+        const std::string& path,
+        const CRFModelConfig& model_config,
+        int batch_size,
+        int chunk_size,
+        const torch::TensorOptions& options,
+        ModelPrecision precision = ModelPrecision::FP32);
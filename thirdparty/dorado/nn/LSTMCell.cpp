@@ -0,0 +1,22 @@
+#include "LSTMCell.h"
+
+#include "LSTMCellImpl.h"
+
+namespace {
+
+LSTMCellKernel select_kernel() {
+#if defined(__x86_64__)
+    LSTMCellKernel avx2 = lstm_cell_avx2_kernel();
+    if (avx2 != nullptr && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return avx2;
+    }
+#endif
+    return lstm_cell<VecBase>;
+}
+
+}  // namespace
+
+void lstm_cell_forward(const float* gates, float* c, float* h, int num_rows, int layer_size) {
+    static const LSTMCellKernel kernel = select_kernel();
+    kernel(gates, c, h, num_rows, layer_size);
+}
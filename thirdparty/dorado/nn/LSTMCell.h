@@ -0,0 +1,7 @@
+#pragma once
+
+// One step of an LSTM layer over num_rows independent rows, on the vector math of
+// utils/simd_math.h. gates holds 4 * layer_size pre-activations per row (input, forget, cell and
+// output gates, in the torch::nn::LSTM order), c the layer_size cell state values per row, updated
+// in place, and the new hidden state is written to h. All three are contiguous.
+void lstm_cell_forward(const float* gates, float* c, float* h, int num_rows, int layer_size);
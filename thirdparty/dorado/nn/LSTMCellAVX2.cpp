@@ -0,0 +1,14 @@
+// AVX2 version of the LSTM cell. Like decode/crf_scan_avx2.cpp, this file is built with -mavx2
+// -mfma on x86-64 and the kernel is only used after checking the CPU at runtime.
+
+#include "LSTMCellImpl.h"
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+LSTMCellKernel lstm_cell_avx2_kernel() { return lstm_cell<VecAVX2>; }
+
+#else
+
+LSTMCellKernel lstm_cell_avx2_kernel() { return nullptr; }
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+// The LSTM cell kernel, shared by LSTMCell.cpp and LSTMCellAVX2.cpp. V is a vector type of
+// utils/simd_math.h and, like the vector math, the kernel lives in an anonymous namespace so that
+// the copies built with different instruction sets never collide.
+
+#include "../utils/simd_math.h"
+
+#include <cstdint>
+
+typedef void (*LSTMCellKernel)(const float*, float*, float*, int, int);
+
+// The AVX2 kernel, or nullptr if LSTMCellAVX2.cpp was not built for AVX2.
+LSTMCellKernel lstm_cell_avx2_kernel();
+
+namespace {
+
+// One LSTM step for num_rows rows: gates holds the four pre-activations (input, forget, cell,
+// output, in the torch order) of each row, 4 * layer_size floats per row, c the cell state, which
+// is updated in place, and the new hidden state is written to h, all contiguous.
+template <class V>
+void lstm_cell(const float* gates, float* c, float* h, int num_rows, int layer_size) {
+    typedef typename V::type type;
+    const int H = layer_size;
+    float lanes[2][V::W];
+
+    for (int n = 0; n < num_rows; n++) {
+        const float* g = gates + (int64_t)n * 4 * H;
+        float* c_row = c + (int64_t)n * H;
+        float* h_row = h + (int64_t)n * H;
+
+        for (int j = 0; j < H; j += V::W) {
+            type gi, gf, gg, go, cj;
+            const int w = (H - j < V::W) ? H - j : V::W;
+            if (w == V::W) {
+                gi = V::load(g + j);
+                gf = V::load(g + H + j);
+                gg = V::load(g + 2 * H + j);
+                go = V::load(g + 3 * H + j);
+                cj = V::load(c_row + j);
+            } else {
+                // partial vector at the end of the row
+                float tail[5][V::W] = {};
+                for (int k = 0; k < w; k++) {
+                    tail[0][k] = g[j + k];
+                    tail[1][k] = g[H + j + k];
+                    tail[2][k] = g[2 * H + j + k];
+                    tail[3][k] = g[3 * H + j + k];
+                    tail[4][k] = c_row[j + k];
+                }
+                gi = V::load(tail[0]);
+                gf = V::load(tail[1]);
+                gg = V::load(tail[2]);
+                go = V::load(tail[3]);
+                cj = V::load(tail[4]);
+            }
+
+            type i = V::sigmoid(gi);
+            type f = V::sigmoid(gf);
+            type u = V::tanh(gg);
+            type o = V::sigmoid(go);
+            cj = V::add(V::mul(f, cj), V::mul(i, u));
+            type hj = V::mul(o, V::tanh(cj));
+
+            if (w == V::W) {
+                V::store(c_row + j, cj);
+                V::store(h_row + j, hj);
+            } else {
+                V::store(lanes[0], cj);
+                V::store(lanes[1], hj);
+                for (int k = 0; k < w; k++) {
+                    c_row[j + k] = lanes[0][k];
+                    h_row[j + k] = lanes[1][k];
+                }
+            }
+        }
+    }
+}
+
+}  // namespace
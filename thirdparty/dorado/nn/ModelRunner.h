@@ -3,16 +3,20 @@
 #include "../decode/Decoder.h"
 #include "CRFModel.h"
 #include "../decode/CPUDecoder.h"
+#include "../utils/tensor_utils.h"
 
 #include "toml.h"
 #include "error.h"
 #include <torch/torch.h>
 
+#include <memory>
 #include <string>
 
 class ModelRunnerBase {
 public:
-    virtual void accept_chunk(int chunk_idx, at::Tensor slice) = 0;
+    // Copies the chunk of signal starting at offset straight into row chunk_idx of the input
+    // buffer, repeat-padding a chunk cut short by the end of the signal.
+    virtual void accept_chunk(int chunk_idx, const at::Tensor &signal, size_t offset) = 0;
     virtual std::vector<DecodedChunk> call_chunks(int num_chunks) = 0;
     virtual size_t model_stride() const = 0;
     virtual size_t chunk_size() const = 0;
@@ -26,13 +30,24 @@ public:
     ModelRunner(const std::string &model_path,
                 const std::string &device,
                 int chunk_size,
-                int batch_size);
-    void accept_chunk(int chunk_idx, at::Tensor slice) final;
+                int batch_size,
+                const DecoderOptions &decoder_options = DecoderOptions(),
+                ModelPrecision precision = ModelPrecision::FP32);
+    ModelRunner(const ModelRunner &) = delete;
+    ModelRunner &operator=(const ModelRunner &) = delete;
+    // A new runner sharing the model of this one. The weights are only read by the forward
+    // passes, so the runners can run concurrently: each gets its own input buffer and decoder.
+    // With a chunk_size, the input buffer is sized for that chunk size instead of this runner's
+    // (for models that take any chunk length, like the CPU model).
+    std::shared_ptr<ModelRunner> share_model(int chunk_size = 0) const;
+    void accept_chunk(int chunk_idx, const at::Tensor &signal, size_t offset) final;
     std::vector<DecodedChunk> call_chunks(int num_chunks) final;
     size_t model_stride() const final { return m_model_stride; }
     size_t chunk_size() const final { return m_input.size(2); }
 
 private:
+    ModelRunner(const ModelRunner &other, int chunk_size);
+
     std::string m_device;
     torch::Tensor m_input;
     torch::TensorOptions m_options;
@@ -46,41 +61,78 @@ template <typename T>
 ModelRunner<T>::ModelRunner(const std::string &model_path,
                             const std::string &device,
                             int chunk_size,
-                            int batch_size) {
+                            int batch_size,
+                            const DecoderOptions &decoder_options,
+                            ModelPrecision precision) {
     const auto model_config = load_crf_model_config(model_path);
     m_model_stride = static_cast<size_t>(model_config.stride);
 
-    m_decoder_options = DecoderOptions();
+    m_decoder_options = decoder_options;
     m_decoder_options.q_shift = model_config.qbias;
     m_decoder_options.q_scale = model_config.qscale;
+    m_decoder_options.byte_score_scale = int8_score_scale;
     m_decoder = std::make_unique<T>();
     m_device = device;
 
     LOG_DEBUG("initialized model runner for device %s", device.c_str());
 
+    // bf16 only pays off with native bf16 matmuls, and is only implemented for the CPU model
+    if (precision == ModelPrecision::BF16 && (device != "cpu" || !cpu_has_bf16())) {
+        WARNING("%s", "bf16 needs a CPU with AVX512-BF16 or AMX, using fp32");
+        precision = ModelPrecision::FP32;
+    }
+    // the model input is kept in the model dtype, so that chunks are only converted once
+    const torch::ScalarType cpu_dtype =
+            (precision == ModelPrecision::BF16) ? torch::kBFloat16 : CPUDecoder::dtype;
+
 #ifdef USE_GPU
     #ifdef USE_CUDA_LSTM
-        m_options = torch::TensorOptions().dtype(T::dtype).device(device); //todo
-        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
+        m_options = torch::TensorOptions().dtype(precision == ModelPrecision::BF16 ? cpu_dtype : T::dtype).device(device); //todo
+        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options, precision);
         chunk_size -= chunk_size % m_model_stride;
-        m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(T::dtype).device(torch::kCPU)); //todo
+        m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(m_options.dtype()).device(torch::kCPU)); //todo
     #else
-        m_options = torch::TensorOptions().dtype(CPUDecoder::dtype).device(device); //todo
-        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
+        m_options = torch::TensorOptions().dtype(cpu_dtype).device(device); //todo
+        m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options, precision);
         chunk_size -= chunk_size % m_model_stride;
-        m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(CPUDecoder::dtype).device(torch::kCPU)); //todo
+        m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(cpu_dtype).device(torch::kCPU)); //todo
     #endif
 #else
-    m_options = torch::TensorOptions().dtype(CPUDecoder::dtype).device(device); //todo
-    m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options);
+    m_options = torch::TensorOptions().dtype(cpu_dtype).device(device); //todo
+    m_module = load_crf_model(model_path, model_config, batch_size, chunk_size, m_options, precision);
     chunk_size -= chunk_size % m_model_stride;
-    m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(CPUDecoder::dtype).device(torch::kCPU)); //todo
+    m_input = torch::zeros({batch_size, 1, chunk_size}, torch::TensorOptions().dtype(cpu_dtype).device(torch::kCPU)); //todo
 #endif
 }
 
+template <typename T>
+ModelRunner<T>::ModelRunner(const ModelRunner &other, int chunk_size)
+        : m_device(other.m_device),
+          m_options(other.m_options),
+          m_decoder(std::make_unique<T>()),
+          m_decoder_options(other.m_decoder_options),
+          m_module(other.m_module),
+          m_model_stride(other.m_model_stride) {
+    if (chunk_size > 0) {
+        chunk_size -= chunk_size % m_model_stride;
+        m_input = torch::zeros({other.m_input.size(0), other.m_input.size(1), chunk_size},
+                               other.m_input.options());
+    } else {
+        m_input = torch::zeros_like(other.m_input);
+    }
+}
+
+template <typename T>
+std::shared_ptr<ModelRunner<T>> ModelRunner<T>::share_model(int chunk_size) const {
+    // not make_shared, which can't reach the private constructor
+    return std::shared_ptr<ModelRunner>(new ModelRunner(*this, chunk_size));
+}
+
 template<typename T> std::vector<DecodedChunk> ModelRunner<T>::call_chunks(int num_chunks) {
     torch::InferenceMode guard;
-    auto scores = m_module->forward(m_input.to(m_options.device_opt().value()));
+    // Only the first num_chunks rows hold chunks, so a partial batch is forwarded with a smaller batch dimension
+    auto input = (num_chunks < m_input.size(0)) ? m_input.narrow(0, 0, num_chunks) : m_input;
+    auto scores = m_module->forward(input.to(m_options.device_opt().value()));
 #ifdef USE_KOI
     return m_decoder->beam_search(scores, num_chunks, m_decoder_options, m_device);
 #else
@@ -88,7 +140,8 @@ template<typename T> std::vector<DecodedChunk> ModelRunner<T>::call_chunks(int n
 #endif
 }
 
-template<typename T> void ModelRunner<T>::accept_chunk(int num_chunks, at::Tensor slice) {
-    m_input.index_put_({num_chunks, 0}, slice);
+template<typename T>
+void ModelRunner<T>::accept_chunk(int chunk_idx, const at::Tensor &signal, size_t offset) {
+    copy_chunk(signal, offset, m_input, chunk_idx);
 }
 
@@ -0,0 +1,197 @@
+#include "PackedModel.h"
+
+#include "CRFModel.h"
+#include "error.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+namespace {
+
+constexpr char packed_model_magic[8] = {'S', 'L', 'O', 'R', 'P', 'A', 'C', 'K'};
+constexpr uint32_t packed_model_version = 1;
+constexpr uint64_t packed_model_alignment = 64;
+constexpr int packed_model_max_dims = 4;
+
+struct PackedModelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_tensors;
+    uint64_t config_offset;
+    uint64_t config_size;
+};
+
+// One per tensor, right after the header
+struct PackedTensorEntry {
+    uint64_t offset;  // float32 data, from the start of the file
+    uint64_t ndim;
+    int64_t sizes[packed_model_max_dims];
+};
+
+uint64_t align_up(uint64_t offset) {
+    return (offset + packed_model_alignment - 1) / packed_model_alignment * packed_model_alignment;
+}
+
+void write_at(FILE* fp, uint64_t offset, const void* data, size_t size, const std::string& path) {
+    if (fseek(fp, long(offset), SEEK_SET) != 0 || fwrite(data, 1, size, fp) != size) {
+        ERROR("cannot write packed model - %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Reads the header and checks that this is a packed model of a known version
+bool read_header(int fd, PackedModelHeader& header) {
+    return pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+           memcmp(header.magic, packed_model_magic, sizeof(packed_model_magic)) == 0 &&
+           header.version == packed_model_version;
+}
+
+int open_packed_model(const std::string& path, PackedModelHeader& header) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        ERROR("cannot open packed model - %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (!read_header(fd, header)) {
+        ERROR("not a packed model of version %u - %s", packed_model_version, path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+}  // namespace
+
+bool is_packed_model(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void pack_crf_model(const std::string& dir, const std::string& out_path) {
+    std::ifstream config_file(dir + "/config.toml");
+    if (!config_file) {
+        ERROR("cannot open toml - %s", (dir + "/config.toml").c_str());
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream config_text;
+    config_text << config_file.rdbuf();
+    const std::string config = config_text.str();
+
+    const auto model_config = load_crf_model_config(dir);
+    auto weights = load_crf_model_weights(dir, model_config.decomposition, model_config.bias);
+
+    FILE* fp = fopen(out_path.c_str(), "wb");
+    if (fp == NULL) {
+        ERROR("cannot open packed model for writing - %s", out_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    PackedModelHeader header = {};
+    memcpy(header.magic, packed_model_magic, sizeof(packed_model_magic));
+    header.version = packed_model_version;
+    header.num_tensors = uint32_t(weights.size());
+    header.config_offset = sizeof(PackedModelHeader) + weights.size() * sizeof(PackedTensorEntry);
+    header.config_size = config.size();
+    write_at(fp, 0, &header, sizeof(header), out_path);
+    write_at(fp, header.config_offset, config.data(), config.size(), out_path);
+
+    uint64_t offset = align_up(header.config_offset + header.config_size);
+    for (size_t i = 0; i < weights.size(); i++) {
+        auto w = weights[i].to(torch::kFloat32).contiguous();
+        if (w.dim() > packed_model_max_dims) {
+            ERROR("cannot pack a tensor with %d dimensions", int(w.dim()));
+            exit(EXIT_FAILURE);
+        }
+
+        PackedTensorEntry entry = {};
+        entry.offset = offset;
+        entry.ndim = w.dim();
+        for (int d = 0; d < w.dim(); d++) {
+            entry.sizes[d] = w.size(d);
+        }
+        write_at(fp, sizeof(PackedModelHeader) + i * sizeof(PackedTensorEntry), &entry,
+                 sizeof(entry), out_path);
+        write_at(fp, offset, w.data_ptr<float>(), w.numel() * sizeof(float), out_path);
+
+        offset = align_up(offset + w.numel() * sizeof(float));
+    }
+
+    if (fclose(fp) != 0) {
+        ERROR("cannot write packed model - %s", out_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::string load_packed_model_config(const std::string& path) {
+    PackedModelHeader header;
+    int fd = open_packed_model(path, header);
+
+    std::string config(header.config_size, '\0');
+    if (pread(fd, &config[0], config.size(), header.config_offset) != ssize_t(config.size())) {
+        ERROR("cannot read the config of packed model - %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    return config;
+}
+
+std::vector<torch::Tensor> load_packed_model_weights(const std::string& path) {
+    PackedModelHeader header;
+    int fd = open_packed_model(path, header);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ERROR("cannot stat packed model - %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    const size_t file_size = st.st_size;
+
+    // A private writable mapping: the pages stay shared with other processes unless written to
+    void* base = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        ERROR("cannot map packed model - %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    std::shared_ptr<void> mapping(base, [file_size](void* p) { munmap(p, file_size); });
+
+    const auto* entries = reinterpret_cast<const PackedTensorEntry*>(
+            static_cast<const char*>(base) + sizeof(PackedModelHeader));
+    if (sizeof(PackedModelHeader) + header.num_tensors * sizeof(PackedTensorEntry) > file_size) {
+        ERROR("truncated packed model - %s", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<torch::Tensor> weights;
+    for (uint32_t i = 0; i < header.num_tensors; i++) {
+        const PackedTensorEntry& entry = entries[i];
+        if (entry.ndim > packed_model_max_dims) {
+            ERROR("corrupt packed model - %s", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+        std::vector<int64_t> sizes(entry.sizes, entry.sizes + entry.ndim);
+        int64_t numel = 1;
+        for (auto size : sizes) {
+            numel *= size;
+        }
+        if (entry.offset + numel * sizeof(float) > file_size) {
+            ERROR("truncated packed model - %s", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        // each view keeps the whole mapping alive
+        weights.push_back(torch::from_blob(
+                static_cast<char*>(base) + entry.offset, sizes, [mapping](void*) {},
+                torch::TensorOptions().dtype(torch::kFloat32)));
+    }
+
+    return weights;
+}
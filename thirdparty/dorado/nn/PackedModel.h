@@ -0,0 +1,24 @@
+#pragma once
+
+#include <torch/torch.h>
+
+#include <string>
+#include <vector>
+
+// A packed model is a single file holding the config.toml of a model directory and all of its
+// weights as raw float32 arrays, each aligned to 64 bytes. The weights are loaded by mapping the
+// file, so that they need no parsing or copying and the pages are shared by all the processes
+// using the same file.
+
+// True if path is a packed model file (rather than a model directory).
+bool is_packed_model(const std::string& path);
+
+// Pack the model directory dir into the file out_path.
+void pack_crf_model(const std::string& dir, const std::string& out_path);
+
+// The config.toml text of a packed model.
+std::string load_packed_model_config(const std::string& path);
+
+// The weights of a packed model, in the order of load_crf_model_weights. The tensors are views of
+// a private mapping of the file, which is unmapped when the last of them is freed.
+std::vector<torch::Tensor> load_packed_model_weights(const std::string& path);
@@ -1,35 +1,236 @@
 
+#include <algorithm>
 #include <cstdint>
 #include <stdlib.h>
+#include <tuple>
 #include <vector>
 
 #include "signal_prep.h"
 
-#define EPS 1e-9f;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-std::pair<float, float> normalisation(torch::Tensor& x) {
-    //Calculate shift and scale factors for normalisation.
-    auto quantiles = quantile_counting(x, torch::tensor({0.2, 0.9}));
-    float q20 = quantiles[0].item<float>();
-    float q90 = quantiles[1].item<float>();
+#define EPS 1e-9f
+
+// Writes (float(x[i]) - shift) / scale of the n raw samples as fp16 bits, rounded like at::Half
+typedef void (*NormaliseKernel)(const int16_t *, int64_t, float, float, uint16_t *);
+
+// The AVX2 and F16C kernel, or nullptr if signal_prep_avx2.cpp was not built for them
+NormaliseKernel normalise_avx2_kernel();
+
+// Counts of the int16 samples of a signal. The bins cover the whole int16 range and live in a
+// buffer reused by each thread: only the bins between the smallest and largest sample are touched,
+// and they are cleared again when the histogram goes away, so one histogram per thread at a time.
+class SignalHistogram {
+public:
+    SignalHistogram(const int16_t *x, int64_t n) : m_n(n) {
+        static thread_local std::vector<uint32_t> buffer(65536, 0);
+        m_counts = buffer.data() + 32768;
+
+        sample_range(x, n, &m_min, &m_max);
+        int64_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            m_counts[x[i]]++;
+            m_counts[x[i + 1]]++;
+            m_counts[x[i + 2]]++;
+            m_counts[x[i + 3]]++;
+        }
+        for (; i < n; i++) {
+            m_counts[x[i]]++;
+        }
+    }
+
+    ~SignalHistogram() { std::fill(m_counts + m_min, m_counts + m_max + 1, 0); }
+
+    SignalHistogram(const SignalHistogram &) = delete;
+    SignalHistogram &operator=(const SignalHistogram &) = delete;
+
+    int64_t size() const { return m_n; }
+
+    // The values at the num_ranks ascending ranks of the sorted samples, in one cumulative scan
+    void values_at_ranks(const int64_t *ranks, int16_t *values, int num_ranks) const {
+        int64_t count = 0;
+        int r = 0;
+        for (int v = m_min; v <= m_max && r < num_ranks; v++) {
+            count += m_counts[v];
+            while (r < num_ranks && count > ranks[r]) {
+                values[r++] = v;
+            }
+        }
+        for (; r < num_ranks; r++) {
+            values[r] = m_max;
+        }
+    }
+
+    // The distance at the given rank of the sorted distances |x - centre|, growing the interval
+    // around centre one value at a time
+    int distance_at_rank(int centre, int64_t rank) const {
+        int64_t count = m_counts[centre];
+        int d = 0;
+        while (count <= rank && (centre - d > m_min || centre + d < m_max)) {
+            d++;
+            if (centre - d >= m_min) {
+                count += m_counts[centre - d];
+            }
+            if (centre + d <= m_max) {
+                count += m_counts[centre + d];
+            }
+        }
+        return d;
+    }
+
+private:
+    static void sample_range(const int16_t *x, int64_t n, int16_t *range_min, int16_t *range_max) {
+        if (n == 0) {
+            *range_min = 0;
+            *range_max = -1;
+            return;
+        }
+        int16_t lo = x[0];
+        int16_t hi = x[0];
+        int64_t i = 0;
+#if defined(__SSE2__)
+        if (n >= 8) {
+            __m128i vlo = _mm_loadu_si128((const __m128i *)x);
+            __m128i vhi = vlo;
+            for (i = 8; i + 8 <= n; i += 8) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+                vlo = _mm_min_epi16(vlo, v);
+                vhi = _mm_max_epi16(vhi, v);
+            }
+            int16_t lanes_lo[8], lanes_hi[8];
+            _mm_storeu_si128((__m128i *)lanes_lo, vlo);
+            _mm_storeu_si128((__m128i *)lanes_hi, vhi);
+            for (int k = 0; k < 8; k++) {
+                lo = std::min(lo, lanes_lo[k]);
+                hi = std::max(hi, lanes_hi[k]);
+            }
+        }
+#elif defined(__aarch64__)
+        if (n >= 8) {
+            int16x8_t vlo = vld1q_s16(x);
+            int16x8_t vhi = vlo;
+            for (i = 8; i + 8 <= n; i += 8) {
+                int16x8_t v = vld1q_s16(x + i);
+                vlo = vminq_s16(vlo, v);
+                vhi = vmaxq_s16(vhi, v);
+            }
+            lo = vminvq_s16(vlo);
+            hi = vmaxvq_s16(vhi);
+        }
+#endif
+        for (; i < n; i++) {
+            lo = std::min(lo, x[i]);
+            hi = std::max(hi, x[i]);
+        }
+        *range_min = lo;
+        *range_max = hi;
+    }
+
+    uint32_t *m_counts;  // indexed by the sample value
+    int64_t m_n;
+    int16_t m_min;
+    int16_t m_max;
+};
+
+// Shift and scale from the 20% and 90% quantiles, the same as quantile_counting(x, {0.2, 0.9})
+static std::pair<float, float> quantile_shift_scale(const SignalHistogram &hist) {
+    // float thresholds truncated to int, like quantile_counting
+    int size = hist.size();
+    int64_t ranks[2] = {int(0.2f * (size - 1)), int(0.9f * (size - 1))};
+    int16_t q[2];
+    hist.values_at_ranks(ranks, q, 2);
+    float q20 = q[0];
+    float q90 = q[1];
     float shift = std::max(10.0f, 0.51f * (q20 + q90));
     float scale = std::max(1.0f, 0.53f * (q90 - q20));
     return std::make_pair(shift, scale);
 }
 
+// Median and scaled median absolute deviation, both lower medians like torch::median
+static std::pair<float, float> med_mad_shift_scale(const SignalHistogram &hist, float factor) {
+    int64_t rank = (hist.size() - 1) / 2;
+    int16_t med;
+    hist.values_at_ranks(&rank, &med, 1);
+    float mad = hist.distance_at_rank(med, rank);
+    return std::make_pair(float(med), mad * factor + EPS);
+}
+
+std::pair<float, float> normalisation(torch::Tensor& x) {
+    //Calculate shift and scale factors for normalisation.
+    auto raw = x.to(torch::kInt16).contiguous();
+    SignalHistogram hist(raw.data_ptr<int16_t>(), raw.size(0));
+    return quantile_shift_scale(hist);
+}
+
 std::pair<float, float> calculate_med_mad(torch::Tensor &x, float factor=1.4826){
+    // The histogram only holds int16 samples, anything else (e.g. an already scaled float signal)
+    // goes through torch
+    if (x.scalar_type() == torch::kInt16) {
+        auto raw = x.contiguous();
+        SignalHistogram hist(raw.data_ptr<int16_t>(), raw.size(0));
+        return med_mad_shift_scale(hist, factor);
+    }
+
     torch::Tensor med = x.median();
     torch::Tensor mad = torch::median(torch::abs(x - med)) * factor + EPS;
 
     return {med.item<float>(), mad.item<float>()};
 }
 
-void scale_signal(torch::Tensor &signal, float scaling, float offset) {
-    auto t1 = normalisation(signal);
-    auto shift = std::get<0>(t1);
-    auto scale = std::get<1>(t1);
+static void normalise_to_half(const int16_t *x, int64_t n, float shift, float scale, uint16_t *out) {
+    int64_t i = 0;
+#if defined(__aarch64__)
+    // fp16 conversion is part of ARMv8, rounding to nearest even like at::Half
+    const float32x4_t vshift = vdupq_n_f32(shift);
+    const float32x4_t vscale = vdupq_n_f32(scale);
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(x + i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        lo = vdivq_f32(vsubq_f32(lo, vshift), vscale);
+        hi = vdivq_f32(vsubq_f32(hi, vshift), vscale);
+        float16x8_t h = vcombine_f16(vcvt_f16_f32(lo), vcvt_f16_f32(hi));
+        vst1q_u16(out + i, vreinterpretq_u16_f16(h));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = at::Half((float(x[i]) - shift) / scale).x;
+    }
+}
+
+static NormaliseKernel select_normalise_kernel() {
+#if defined(__x86_64__)
+    NormaliseKernel avx2 = normalise_avx2_kernel();
+    if (avx2 != nullptr && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+        return avx2;
+    }
+#endif
+    return normalise_to_half;
+}
 
-    signal = ((signal.to(torch::kFloat) - shift) / scale).to(torch::kFloat16);
+void scale_signal(torch::Tensor &signal, float scaling, float offset, SignalNormalisation norm) {
+    // The shift and scale of normalisation() (or calculate_med_mad()) and the fp16 values of
+    // ((signal.to(kFloat) - shift) / scale).to(kFloat16), computed straight from the raw samples
+    // without temporary tensors
+    auto raw_signal = signal.to(torch::kInt16).contiguous();
+    const int16_t *raw = raw_signal.data_ptr<int16_t>();
+    const int64_t n = raw_signal.size(0);
+
+    float shift, scale;
+    {
+        SignalHistogram hist(raw, n);
+        std::tie(shift, scale) = norm == SignalNormalisation::MedMad
+                                         ? med_mad_shift_scale(hist, 1.4826f)
+                                         : quantile_shift_scale(hist);
+    }
+
+    static const NormaliseKernel normalise = select_normalise_kernel();
+    signal = torch::empty({n}, torch::kFloat16);
+    normalise(raw, n, shift, scale, reinterpret_cast<uint16_t *>(signal.data_ptr<at::Half>()));
 
     scale = scaling * scale;
     shift = scaling * (shift + offset);
@@ -41,6 +242,51 @@ void scale_signal(torch::Tensor &signal, float scaling, float offset) {
     signal = signal.index({torch::indexing::Slice(trim_start, torch::indexing::None)});
 }
 
+// Number of the n fp16 values (given as their bits) that are greater than the fp16 value with
+// bits t, for t >= +0. For such thresholds, the comparison of the values is the signed comparison
+// of their bits, as long as NaNs (bits above 0x7c00) are left out.
+static int count_greater_fp16(const uint16_t *x, int n, uint16_t t) {
+    int count = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i threshold = _mm_set1_epi16((int16_t)t);
+    const __m128i nan = _mm_set1_epi16(0x7c01);
+    while (i + 8 <= n) {
+        // 16-bit lane counters, flushed before they can overflow
+        const int block_end = std::min(n, i + 8 * 65535);
+        __m128i counts = _mm_setzero_si128();
+        for (; i + 8 <= block_end; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+            __m128i greater =
+                    _mm_and_si128(_mm_cmpgt_epi16(v, threshold), _mm_cmplt_epi16(v, nan));
+            counts = _mm_sub_epi16(counts, greater);  // the lanes of greater are 0 or -1
+        }
+        uint16_t lanes[8];
+        _mm_storeu_si128((__m128i *)lanes, counts);
+        for (int k = 0; k < 8; k++) {
+            count += lanes[k];
+        }
+    }
+#elif defined(__aarch64__)
+    const int16x8_t threshold = vdupq_n_s16((int16_t)t);
+    const int16x8_t nan = vdupq_n_s16(0x7c01);
+    while (i + 8 <= n) {
+        const int block_end = std::min(n, i + 8 * 65535);
+        uint16x8_t counts = vdupq_n_u16(0);
+        for (; i + 8 <= block_end; i += 8) {
+            int16x8_t v = vreinterpretq_s16_u16(vld1q_u16(x + i));
+            uint16x8_t greater = vandq_u16(vcgtq_s16(v, threshold), vcltq_s16(v, nan));
+            counts = vsubq_u16(counts, greater);
+        }
+        count += vaddlvq_u16(counts);
+    }
+#endif
+    for (; i < n; i++) {
+        count += ((int16_t)x[i] > (int16_t)t) && ((int16_t)x[i] < 0x7c01);
+    }
+    return count;
+}
+
 int trim(
     torch::Tensor signal,
     int window_size,
@@ -52,37 +298,64 @@ int trim(
     int min_trim = 10;
     bool seen_peak = false;
     int num_samples = std::min(max_samples, static_cast<int>(signal.size(0)) - min_trim);
+    if (window_size < 1) {
+        return min_trim;
+    }
     int num_windows = num_samples / window_size;
 
+    // The windows are counted on a plain buffer. Like the tensor comparison, the count compares the
+    // samples with the threshold cast to the signal type (fp16: 2.4 -> 2.400390625), whereas the
+    // last sample of a window is compared as a float.
+    const bool fp16 = signal.scalar_type() == torch::kFloat16;
+    auto samples = fp16 ? signal.contiguous() : signal.to(torch::kFloat).contiguous();
+    const uint16_t *bits = fp16 ? (const uint16_t *)samples.data_ptr<at::Half>() : nullptr;
+    const float *values = fp16 ? nullptr : samples.data_ptr<float>();
+    const at::Half threshold_fp16 = threshold;
+    const bool count_bits = fp16 && !(threshold_fp16.x & 0x8000) && threshold_fp16.x <= 0x7c00;
+
     for (int pos = 0; pos < num_windows; pos++) {
         int start = pos * window_size + min_trim;
         int end = start + window_size;
 
-        auto window = signal.index({torch::indexing::Slice(start, end)});
-        auto elements = window > threshold;
-
-        if ((elements.sum().item<int>() > min_elements) || seen_peak) {
-            seen_peak = true;
-            if (window[-1].item<float>() > threshold) {
-                continue;
-            }
-            if (end >= num_samples || end >= (max_trim * signal.size(0))) {
-                return min_trim;
+        if (!seen_peak) {
+            int count = 0;
+            if (count_bits) {
+                count = count_greater_fp16(bits + start, window_size, threshold_fp16.x);
+            } else if (fp16) {
+                for (int i = start; i < end; i++) {
+                    at::Half x(bits[i], at::Half::from_bits());
+                    count += float(x) > float(threshold_fp16);
+                }
             } else {
-                return end;
+                for (int i = start; i < end; i++) {
+                    count += values[i] > threshold;
+                }
+            }
+            if (count <= min_elements) {
+                continue;
             }
         }
+
+        seen_peak = true;
+        float last =
+                fp16 ? float(at::Half(bits[end - 1], at::Half::from_bits())) : values[end - 1];
+        if (last > threshold) {
+            continue;
+        }
+        if (end >= num_samples || end >= (max_trim * signal.size(0))) {
+            return min_trim;
+        } else {
+            return end;
+        }
     }
 
     return min_trim;
 }
 
 torch::Tensor tensor_from_record(slow5_rec_t *rec) {
-    std::vector<int16_t> tmp(rec->raw_signal,rec->raw_signal+rec->len_raw_signal);
-    std::vector<int16_t> floatTmp(tmp.begin(), tmp.end());
-
+    // a view of the decoded signal of the record, no copy
     torch::TensorOptions options = torch::TensorOptions().dtype(torch::kInt16);
-    return torch::from_blob(floatTmp.data(), floatTmp.size(), options).clone().to("cpu");
+    return torch::from_blob(rec->raw_signal, {(int64_t)rec->len_raw_signal}, options);
 }
 
 std::vector<Chunk *> chunks_from_tensor(torch::Tensor &tensor, int chunk_size, int overlap) {
@@ -101,36 +374,3 @@ std::vector<Chunk *> chunks_from_tensor(torch::Tensor &tensor, int chunk_size, i
 
     return chunks;
 }
-
-std::vector<torch::Tensor> tensor_as_chunks(torch::Tensor &signal, std::vector<Chunk *> &chunks, size_t chunk_size) {
-    std::vector<torch::Tensor> tensors;
-
-    for (size_t i = 0; i < chunks.size(); ++i) {
-        auto input_slice = signal.index({torch::indexing::Ellipsis, torch::indexing::Slice(chunks[i]->input_offset, chunks[i]->input_offset + chunk_size)});
-        size_t slice_size;
-        if (input_slice.ndimension() == 1) slice_size = input_slice.size(0);
-        else slice_size = input_slice.sizes()[1];
-
-        // repeat-pad any non-full chunks
-        // Stereo and Simplex encoding need to be treated differently
-        if (slice_size != chunk_size) {
-            if (input_slice.ndimension() == 1) {
-                auto t0 = std::div((int)chunk_size, (int)slice_size);
-                auto n = t0.quot;
-                auto overhang = t0.rem;
-                input_slice = torch::concat({input_slice.repeat({n}), input_slice.index({torch::indexing::Ellipsis, torch::indexing::Slice(0, overhang)})});
-            } else if (input_slice.ndimension() == 2) {
-                auto t0 = std::div((int)chunk_size, (int)slice_size);
-                auto n = t0.quot;
-                auto overhang = t0.rem;
-                input_slice = torch::concat(
-                            {input_slice.repeat({1, n}),
-                             input_slice.index({torch::indexing::Ellipsis, torch::indexing::Slice(0, overhang)})},
-                            1);
-            }
-        }
-        tensors.push_back(input_slice);
-    }
-
-    return tensors;
-}
\ No newline at end of file
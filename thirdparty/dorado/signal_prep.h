@@ -12,6 +12,8 @@
 #include "utils/tensor_utils.h"
 #include "Chunk.h"
 
+// The raw signal of rec as an int16 tensor. The tensor is a view of the record's signal, so it
+// must not outlive the record (scale_signal replaces it with a new, normalised tensor).
 torch::Tensor tensor_from_record(slow5_rec_t *rec);
 std::pair<float, float> normalisation(torch::Tensor& x);
 int trim(
@@ -22,8 +24,13 @@ int trim(
     int max_samples = 8000,
     float max_trim = 0.3
 );
-void scale_signal(torch::Tensor &signal, float scaling, float offset);
+// How scale_signal finds the shift and scale of a signal: from its 20% and 90% quantiles, or from
+// its median and median absolute deviation, for models trained on med/MAD normalised signals
+enum class SignalNormalisation { Quantile, MedMad };
+void scale_signal(torch::Tensor &signal,
+                  float scaling,
+                  float offset,
+                  SignalNormalisation norm = SignalNormalisation::Quantile);
 std::vector<Chunk *> chunks_from_tensor(torch::Tensor &tensor, int chunk_size, int overlap);
-std::vector<torch::Tensor> tensor_as_chunks(torch::Tensor &signal, std::vector<Chunk *> &chunks, size_t chunk_size);
 
 #endif
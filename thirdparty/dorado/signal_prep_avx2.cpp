@@ -0,0 +1,57 @@
+// AVX2 and F16C version of the signal normalisation in signal_prep.cpp. Like
+// decode/crf_scan_avx2.cpp, this file is built with -mavx2 -mf16c on x86-64 and the kernel is only
+// used after checking the CPU at runtime, so it must not include torch or any other header with
+// inline functions that the other translation units share.
+
+#include <cstdint>
+
+typedef void (*NormaliseKernel)(const int16_t *, int64_t, float, float, uint16_t *);
+
+#if defined(__AVX2__) && defined(__F16C__)
+
+#include <immintrin.h>
+
+// (float(x[i]) - shift) / scale of the n samples, as fp16 bits. The division and the rounding to
+// nearest even are those of the scalar at::Half path, so the output is bit-identical.
+static void normalise_to_half_avx2(const int16_t *x, int64_t n, float shift, float scale,
+                                   uint16_t *out) {
+    const __m256 vshift = _mm256_set1_ps(shift);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    int64_t i = 0;
+    for (; i < n; i += 8) {
+        __m128i v;
+        int16_t tail[8] = {};
+        const int w = (n - i < 8) ? int(n - i) : 8;
+        if (w == 8) {
+            v = _mm_loadu_si128((const __m128i *)(x + i));
+        } else {
+            // partial vector at the end of the signal
+            for (int k = 0; k < w; k++) {
+                tail[k] = x[i + k];
+            }
+            v = _mm_loadu_si128((const __m128i *)tail);
+        }
+
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        f = _mm256_div_ps(_mm256_sub_ps(f, vshift), vscale);
+        __m128i h = _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT);
+
+        if (w == 8) {
+            _mm_storeu_si128((__m128i *)(out + i), h);
+        } else {
+            uint16_t lanes[8];
+            _mm_storeu_si128((__m128i *)lanes, h);
+            for (int k = 0; k < w; k++) {
+                out[i + k] = lanes[k];
+            }
+        }
+    }
+}
+
+NormaliseKernel normalise_avx2_kernel() { return normalise_to_half_avx2; }
+
+#else
+
+NormaliseKernel normalise_avx2_kernel() { return nullptr; }
+
+#endif
@@ -0,0 +1,264 @@
+#pragma once
+
+// Elementwise single precision vector math shared by the CPU kernels, the CRF scans in decode/ and
+// the LSTM cell in nn/.
+//
+// A vector type V holds V::W floats and provides load/store/set1/add/sub/mul/div/max/fmadd,
+// exp (of non-positive values), log (of normal, positive values), sigmoid and tanh. VecBase is
+// available on every CPU of the target architecture; VecAVX2 is only defined in translation units
+// built with -mavx2 -mfma, whose kernels may only run after checking the CPU at runtime. Everything
+// lives in an anonymous namespace, so the copies built with different instruction sets in different
+// translation units never collide.
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// exp(x) for x <= 0, Cephes single precision polynomial
+template <class V>
+inline typename V::type exp_poly(typename V::type x) {
+    typedef typename V::type type;
+    // exp(-87.34) is the smallest normal float
+    x = V::max(x, V::set1(-87.3365447504f));
+    type n = V::round(V::mul(x, V::set1(1.44269504088896341f)));
+    x = V::sub(x, V::mul(n, V::set1(0.693359375f)));
+    x = V::sub(x, V::mul(n, V::set1(-2.12194440e-4f)));
+
+    type y = V::set1(1.9875691500e-4f);
+    y = V::fmadd(y, x, V::set1(1.3981999507e-3f));
+    y = V::fmadd(y, x, V::set1(8.3334519073e-3f));
+    y = V::fmadd(y, x, V::set1(4.1665795894e-2f));
+    y = V::fmadd(y, x, V::set1(1.6666665459e-1f));
+    y = V::fmadd(y, x, V::set1(5.0000001201e-1f));
+    y = V::fmadd(y, V::mul(x, x), V::add(x, V::set1(1.0f)));
+
+    return V::mul(y, V::pow2n(n));
+}
+
+// log(x) for normal, positive x, Cephes single precision polynomial
+template <class V>
+inline typename V::type log_poly(typename V::type x) {
+    typedef typename V::type type;
+    type e;
+    type m = V::mant_exp(x, &e);  // x = m * 2^e, m in [0.5, 1)
+
+    type mask = V::cmplt(m, V::set1(0.707106781186547524f));
+    e = V::sub(e, V::and_(mask, V::set1(1.0f)));
+    m = V::add(V::sub(m, V::set1(1.0f)), V::and_(mask, m));
+
+    type z = V::mul(m, m);
+    type y = V::set1(7.0376836292e-2f);
+    y = V::fmadd(y, m, V::set1(-1.1514610310e-1f));
+    y = V::fmadd(y, m, V::set1(1.1676998740e-1f));
+    y = V::fmadd(y, m, V::set1(-1.2420140846e-1f));
+    y = V::fmadd(y, m, V::set1(1.4249322787e-1f));
+    y = V::fmadd(y, m, V::set1(-1.6668057665e-1f));
+    y = V::fmadd(y, m, V::set1(2.0000714765e-1f));
+    y = V::fmadd(y, m, V::set1(-2.4999993993e-1f));
+    y = V::fmadd(y, m, V::set1(3.3333331174e-1f));
+    y = V::mul(V::mul(y, m), z);
+
+    y = V::fmadd(e, V::set1(-2.12194440e-4f), y);
+    y = V::fmadd(z, V::set1(-0.5f), y);
+    m = V::add(m, y);
+    return V::fmadd(e, V::set1(0.693359375f), m);
+}
+
+// 1 / (1 + exp(-x)), using exp(-|x|) so that exp never overflows
+template <class V>
+inline typename V::type sigmoid_poly(typename V::type x) {
+    typedef typename V::type type;
+    const type zero = V::set1(0.0f);
+    const type one = V::set1(1.0f);
+    type e = V::exp(V::sub(zero, V::max(x, V::sub(zero, x))));
+    type r = V::div(one, V::add(one, e));
+    // sigmoid(x) = r for x >= 0 and e * r = r - r * (1 - e) for x < 0
+    return V::sub(r, V::and_(V::cmplt(x, zero), V::mul(r, V::sub(one, e))));
+}
+
+// tanh(x) = 2 * sigmoid(2x) - 1
+template <class V>
+inline typename V::type tanh_poly(typename V::type x) {
+    const typename V::type two = V::set1(2.0f);
+    return V::sub(V::mul(two, V::sigmoid(V::mul(two, x))), V::set1(1.0f));
+}
+
+#if defined(__x86_64__) || defined(__SSE2__)
+
+// SSE2 is part of x86-64.
+struct VecSSE2 {
+    typedef __m128 type;
+    static constexpr int W = 4;
+
+    static type load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, type x) { _mm_storeu_ps(p, x); }
+    static type set1(float x) { return _mm_set1_ps(x); }
+    static type add(type a, type b) { return _mm_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm_div_ps(a, b); }
+    static type max(type a, type b) { return _mm_max_ps(a, b); }
+    static type fmadd(type a, type b, type c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static type cmplt(type a, type b) { return _mm_cmplt_ps(a, b); }
+    static type and_(type a, type b) { return _mm_and_ps(a, b); }
+    static type round(type x) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(x)); }
+    static type pow2n(type n) {
+        __m128i e = _mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127));
+        return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+    }
+    static type mant_exp(type x, type* e) {
+        __m128i bits = _mm_castps_si128(x);
+        *e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+        bits = _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                            _mm_set1_epi32(0x3f000000));
+        return _mm_castsi128_ps(bits);
+    }
+    static type exp(type x) { return exp_poly<VecSSE2>(x); }
+    static type log(type x) { return log_poly<VecSSE2>(x); }
+    static type sigmoid(type x) { return sigmoid_poly<VecSSE2>(x); }
+    static type tanh(type x) { return tanh_poly<VecSSE2>(x); }
+};
+typedef VecSSE2 VecBase;
+
+#elif defined(__aarch64__)
+
+struct VecNEON {
+    typedef float32x4_t type;
+    static constexpr int W = 4;
+
+    static type load(const float* p) { return vld1q_f32(p); }
+    static void store(float* p, type x) { vst1q_f32(p, x); }
+    static type set1(float x) { return vdupq_n_f32(x); }
+    static type add(type a, type b) { return vaddq_f32(a, b); }
+    static type sub(type a, type b) { return vsubq_f32(a, b); }
+    static type mul(type a, type b) { return vmulq_f32(a, b); }
+    static type div(type a, type b) { return vdivq_f32(a, b); }
+    static type max(type a, type b) { return vmaxq_f32(a, b); }
+    static type fmadd(type a, type b, type c) { return vfmaq_f32(c, a, b); }
+    static type cmplt(type a, type b) { return vreinterpretq_f32_u32(vcltq_f32(a, b)); }
+    static type and_(type a, type b) {
+        return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)));
+    }
+    static type round(type x) { return vcvtq_f32_s32(vcvtnq_s32_f32(x)); }
+    static type pow2n(type n) {
+        int32x4_t e = vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127));
+        return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+    }
+    static type mant_exp(type x, type* e) {
+        int32x4_t bits = vreinterpretq_s32_f32(x);
+        *e = vcvtq_f32_s32(vsubq_s32(vshrq_n_s32(bits, 23), vdupq_n_s32(126)));
+        bits = vorrq_s32(vandq_s32(bits, vdupq_n_s32(0x007fffff)), vdupq_n_s32(0x3f000000));
+        return vreinterpretq_f32_s32(bits);
+    }
+    static type exp(type x) { return exp_poly<VecNEON>(x); }
+    static type log(type x) { return log_poly<VecNEON>(x); }
+    static type sigmoid(type x) { return sigmoid_poly<VecNEON>(x); }
+    static type tanh(type x) { return tanh_poly<VecNEON>(x); }
+};
+typedef VecNEON VecBase;
+
+#else
+
+// Portable fallback.
+struct VecScalar {
+    struct type {
+        float v[4];
+    };
+    static constexpr int W = 4;
+
+    static type load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+    static void store(float* p, type x) {
+        for (int i = 0; i < 4; i++) {
+            p[i] = x.v[i];
+        }
+    }
+    static type set1(float x) { return {{x, x, x, x}}; }
+    static type add(type a, type b) {
+        return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+    }
+    static type sub(type a, type b) {
+        return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}};
+    }
+    static type mul(type a, type b) {
+        return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+    }
+    static type div(type a, type b) {
+        return {{a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]}};
+    }
+    static type max(type a, type b) {
+        return {{std::fmax(a.v[0], b.v[0]), std::fmax(a.v[1], b.v[1]), std::fmax(a.v[2], b.v[2]),
+                 std::fmax(a.v[3], b.v[3])}};
+    }
+    static type exp(type x) {
+        return {{std::exp(x.v[0]), std::exp(x.v[1]), std::exp(x.v[2]), std::exp(x.v[3])}};
+    }
+    static type log(type x) {
+        return {{std::log(x.v[0]), std::log(x.v[1]), std::log(x.v[2]), std::log(x.v[3])}};
+    }
+    static type sigmoid(type x) {
+        type y;
+        for (int i = 0; i < 4; i++) {
+            y.v[i] = 1.0f / (1.0f + std::exp(-x.v[i]));
+        }
+        return y;
+    }
+    static type tanh(type x) {
+        return {{std::tanh(x.v[0]), std::tanh(x.v[1]), std::tanh(x.v[2]), std::tanh(x.v[3])}};
+    }
+};
+typedef VecScalar VecBase;
+
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+struct VecAVX2 {
+    typedef __m256 type;
+    static constexpr int W = 8;
+
+    static type load(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, type x) { _mm256_storeu_ps(p, x); }
+    static type set1(float x) { return _mm256_set1_ps(x); }
+    static type add(type a, type b) { return _mm256_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm256_div_ps(a, b); }
+    static type max(type a, type b) { return _mm256_max_ps(a, b); }
+    static type fmadd(type a, type b, type c) { return _mm256_fmadd_ps(a, b, c); }
+    static type cmplt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static type and_(type a, type b) { return _mm256_and_ps(a, b); }
+    static type round(type x) {
+        return _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    }
+    static type pow2n(type n) {
+        __m256i e = _mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127));
+        return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+    }
+    static type mant_exp(type x, type* e) {
+        __m256i bits = _mm256_castps_si256(x);
+        *e = _mm256_cvtepi32_ps(
+                _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+        bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                               _mm256_set1_epi32(0x3f000000));
+        return _mm256_castsi256_ps(bits);
+    }
+    static type exp(type x) { return exp_poly<VecAVX2>(x); }
+    static type log(type x) { return log_poly<VecAVX2>(x); }
+    static type sigmoid(type x) { return sigmoid_poly<VecAVX2>(x); }
+    static type tanh(type x) { return tanh_poly<VecAVX2>(x); }
+};
+
+#endif
+
+}  // namespace
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <experimental/filesystem>
 #include <torch/csrc/jit/serialization/pickle.h>
@@ -79,4 +80,32 @@ torch::Tensor quantile_counting(const torch::Tensor t, const torch::Tensor q) {
     }
 
     return res;
-}
\ No newline at end of file
+}
+
+void copy_chunk(const torch::Tensor& signal, size_t offset, torch::Tensor& dst, int row) {
+    assert(signal.dim() == 1 && dst.dim() == 3 && dst.size(1) == 1 && dst.is_contiguous());
+
+    auto src = signal.contiguous();
+    const size_t chunk_size = dst.size(2);
+    const size_t signal_size = src.size(0);
+    const size_t available = offset < signal_size ? std::min(chunk_size, signal_size - offset) : 0;
+
+    AT_DISPATCH_FLOATING_TYPES_AND2(at::kHalf, at::kBFloat16, dst.scalar_type(), "copy_chunk", [&] {
+        using dst_t = scalar_t;
+        dst_t* out = dst.data_ptr<dst_t>() + row * dst.stride(0);
+        if (available == 0) {
+            std::fill(out, out + chunk_size, dst_t(0));
+            return;
+        }
+        AT_DISPATCH_ALL_TYPES_AND2(at::kHalf, at::kBFloat16, src.scalar_type(), "copy_chunk", [&] {
+            const scalar_t* in = src.data_ptr<scalar_t>() + offset;
+            for (size_t k = 0; k < available; k++) {
+                out[k] = static_cast<dst_t>(static_cast<float>(in[k]));
+            }
+            // repeat the copied samples over the rest of the row
+            for (size_t k = available; k < chunk_size; k++) {
+                out[k] = out[k - available];
+            }
+        });
+    });
+}
@@ -21,6 +21,11 @@ torch::Tensor quantile(const torch::Tensor t, const torch::Tensor q);
 // Only `interpolation='lower'` is currently implemented.
 torch::Tensor quantile_counting(const torch::Tensor t, const torch::Tensor q);
 
+// Copies the samples of the 1D tensor `signal` from `offset` into row `row` of the contiguous
+// {N, 1, chunk_size} tensor `dst`, converted to the dtype of dst. A chunk cut short by the end of
+// the signal is repeat-padded: sample k of the row is signal[offset + k % available_samples].
+void copy_chunk(const torch::Tensor& signal, size_t offset, torch::Tensor& dst, int row);
+
 // temporary
 inline void module_load_state_dict(torch::nn::Module& module,
                             const std::vector<torch::Tensor>& weights,
@@ -35,3 +40,19 @@ inline void module_load_state_dict(torch::nn::Module& module,
         module.buffers()[idx].data() = buffers[idx].data();
     }
 }
+
+// Like module_load_state_dict, but the parameters become the given tensors instead of copies of
+// them, so the module shares their memory.
+inline void module_share_state_dict(torch::nn::Module& module,
+                                    const std::vector<torch::Tensor>& weights) {
+    auto parameters = module.parameters();
+    if (weights.size() != parameters.size()) {
+        throw std::runtime_error("module_share_state_dict: mismatched number of weights");
+    }
+    for (size_t idx = 0; idx < weights.size(); idx++) {
+        if (!parameters[idx].sizes().equals(weights[idx].sizes())) {
+            throw std::runtime_error("module_share_state_dict: mismatched weight shape");
+        }
+        parameters[idx].set_data(weights[idx]);
+    }
+}